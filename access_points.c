@@ -0,0 +1,262 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Access point file layout (all integers little-endian):
+
+   off type    descr
+     0 uint32  Magic number 0x32504848 ("HHP2")
+     4         Stamp of the archive file (see archive_stamp())
+    28 uint32  Number of entries in the archive (I)
+    32 uint32  Number of access points (P)
+    36 uint32  Minimum distance between access points (decoded bytes)
+    40         Reserved (0), 8 bytes
+    48         I + 1 uint32: index of the first access point of each entry;
+               the points of entry i are those in [first[i], first[i + 1])
+     T         P access points of 16 bytes (T is the next multiple of 16):
+                 uint32  Position in the decoded data
+                 uint32  Position in the stored data (see find_deflate_points)
+                 uint32  Number of bits to take from the preceding byte
+                 uint32  Reserved (0)
+     W         P windows of DEFLATE_WINDOW bytes (W = T + 16*P)
+
+   Access points are sorted by position within each entry. Only deflated
+   entries have access points; the start of an entry is not one. */
+#define POINTS_MAGIC        0x32504848ul
+#define POINTS_HEADER_SIZE  48
+#define POINT_SIZE          16
+
+size_t access_span = 1 << 20;
+
+struct PointList
+{
+    unsigned char   *points;    /* Access points */
+    unsigned char   *windows;   /* Their windows */
+    size_t          size, capacity;
+};
+
+static void add_point( void *arg, size_t decoded, size_t stored, int bits,
+                       const unsigned char *window )
+{
+    struct PointList *pl = arg;
+
+    if (pl->size == pl->capacity)
+    {
+        pl->capacity = pl->capacity > 0 ? 2*pl->capacity : 16;
+        pl->points   = realloc(pl->points, POINT_SIZE*pl->capacity);
+        pl->windows  = realloc(pl->windows, DEFLATE_WINDOW*pl->capacity);
+        if (pl->points == NULL || pl->windows == NULL)
+        {
+            perror("Could not allocate memory for access points");
+            abort();
+        }
+    }
+    put_uint32(pl->points + POINT_SIZE*pl->size,      (uint32_t)decoded);
+    put_uint32(pl->points + POINT_SIZE*pl->size + 4,  (uint32_t)stored);
+    put_uint32(pl->points + POINT_SIZE*pl->size + 8,  (uint32_t)bits);
+    put_uint32(pl->points + POINT_SIZE*pl->size + 12, 0);
+    memcpy(pl->windows + DEFLATE_WINDOW*pl->size, window, DEFLATE_WINDOW);
+    pl->size++;
+}
+
+/* Returns the offset of the access points in a file for I entries */
+static size_t points_table_pos(size_t entries_size)
+{
+    return (POINTS_HEADER_SIZE + 4*(entries_size + 1) + 15)/16*16;
+}
+
+void write_access_points(const char *archive_path)
+{
+    Archive *ar;
+    struct PointList pl;
+    char path[PATH_LEN];
+    unsigned char *data, stamp[SIDECAR_STAMP_SIZE], *first;
+    size_t i, pos, size;
+
+    ar = open_archive(archive_path);
+    if (!archive_stamp(ar, stamp))
+    {
+        fprintf(stderr, "%s: not a regular file.\n", archive_path);
+        exit(1);
+    }
+
+    /* Find access points of deflated entries that are large enough */
+    first = malloc(4*(ar->entries_size + 1));
+    assert(first != NULL);
+    memset(&pl, 0, sizeof(pl));
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        put_uint32(first + 4*i, (uint32_t)pl.size);
+        if (ar->codecs[i] != COM_DEFLATE || ar->sizes[i] <= access_span)
+            continue;
+        seek_entry(ar, i);
+        find_deflate_points( ar->fp, ar->stored_sizes[i], access_span,
+                             add_point, &pl );
+    }
+    put_uint32(first + 4*ar->entries_size, (uint32_t)pl.size);
+
+    sidecar_path(archive_path, ".hhp", path);
+    if (pl.size == 0)
+    {
+        /* No entry benefits; remove a stale file, if any */
+        remove(path);
+    }
+    else
+    {
+        pos  = points_table_pos(ar->entries_size);
+        size = pos + (POINT_SIZE + DEFLATE_WINDOW)*pl.size;
+        data = calloc(size, 1);
+        assert(data != NULL);
+        put_uint32(data, POINTS_MAGIC);
+        memcpy(data + 4, stamp, SIDECAR_STAMP_SIZE);
+        put_uint32(data + 28, (uint32_t)ar->entries_size);
+        put_uint32(data + 32, (uint32_t)pl.size);
+        put_uint32(data + 36, (uint32_t)access_span);
+        memcpy(data + POINTS_HEADER_SIZE, first, 4*(ar->entries_size + 1));
+        memcpy(data + pos, pl.points, POINT_SIZE*pl.size);
+        memcpy(data + pos + POINT_SIZE*pl.size, pl.windows,
+               DEFLATE_WINDOW*pl.size);
+        write_sidecar(path, data, size);
+        free(data);
+    }
+
+    free(first);
+    free(pl.points);
+    free(pl.windows);
+    close_archive(ar);
+}
+
+void load_access_points(Archive *ar)
+{
+    char path[PATH_LEN];
+    unsigned char stamp[SIDECAR_STAMP_SIZE];
+    size_t count;
+
+    if (!ar->seekable || strcmp(ar->path, "-") == 0) return;
+    sidecar_path(ar->path, ".hhp", path);
+    ar->points = map_sidecar(path, &ar->points_size);
+    if (ar->points == NULL) return;
+
+    /* Use the access points only if they match the archive */
+    if (!archive_stamp(ar, stamp) ||
+        ar->points_size < points_table_pos(ar->entries_size) ||
+        get_uint32(ar->points) != POINTS_MAGIC ||
+        memcmp(ar->points + 4, stamp, SIDECAR_STAMP_SIZE) != 0 ||
+        get_uint32(ar->points + 28) != ar->entries_size ||
+        (count = get_uint32(ar->points + 32)) != get_uint32(ar->points +
+            POINTS_HEADER_SIZE + 4*ar->entries_size) ||
+        ar->points_size != points_table_pos(ar->entries_size) +
+                           (POINT_SIZE + DEFLATE_WINDOW)*count)
+    {
+        unload_access_points(ar);
+    }
+}
+
+void unload_access_points(Archive *ar)
+{
+    if (ar->points == NULL) return;
+    unmap_sidecar(ar->points, ar->points_size);
+    ar->points      = NULL;
+    ar->points_size = 0;
+}
+
+/* Returns the last access point of entry i at or before decoded position
+   ``offset'', or (size_t)-1 if there is none. */
+static size_t find_point(const Archive *ar, size_t i, size_t offset)
+{
+    const unsigned char *table;
+    size_t lo, hi, mid, count;
+
+    if (ar->points == NULL) return (size_t)-1;
+    count = get_uint32(ar->points + 32);
+    lo = get_uint32(ar->points + POINTS_HEADER_SIZE + 4*i);
+    hi = get_uint32(ar->points + POINTS_HEADER_SIZE + 4*(i + 1));
+    if (lo > hi || hi > count) return (size_t)-1;
+
+    table = ar->points + points_table_pos(ar->entries_size);
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        if (get_uint32(table + POINT_SIZE*mid) <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > get_uint32(ar->points + POINTS_HEADER_SIZE + 4*i) ?
+           lo - 1 : (size_t)-1;
+}
+
+/* Reads the range of a deflated entry, starting at the nearest access
+   point, if there is one. */
+static size_t pread_deflated( Archive *ar, size_t i, void *buf,
+                              size_t offset, size_t len )
+{
+    const unsigned char *point, *window = NULL;
+    size_t k, decoded = 0, stored = 0, count;
+    int bits = 0;
+
+    k = find_point(ar, i, offset);
+    if (k != (size_t)-1)
+    {
+        count   = get_uint32(ar->points + 32);
+        point   = ar->points + points_table_pos(ar->entries_size) +
+                  POINT_SIZE*k;
+        decoded = get_uint32(point);
+        stored  = get_uint32(point + 4);
+        bits    = (int)get_uint32(point + 8);
+        window  = ar->points + points_table_pos(ar->entries_size) +
+                  POINT_SIZE*count + DEFLATE_WINDOW*k;
+        if (stored > ar->stored_sizes[i] || stored < 1 || bits > 7)
+        {
+            /* Corrupt access point; decode from the start */
+            decoded = stored = 0;
+            bits    = 0;
+            window  = NULL;
+        }
+    }
+    if (bits > 0) --stored;
+
+    if (fseek(ar->fp, (long)(ar->offsets[i] + stored), SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+    return inflate_from( buf, len, offset - decoded, ar->fp,
+                         ar->stored_sizes[i] - stored, bits, window );
+}
+
+size_t pread_entry( Archive *ar, size_t i, void *buf,
+                    size_t offset, size_t len )
+{
+    if (offset >= ar->sizes[i]) return 0;
+    if (len > ar->sizes[i] - offset) len = ar->sizes[i] - offset;
+
+    switch (ar->codecs[i])
+    {
+    case COM_NONE:
+        if (offset >= ar->stored_sizes[i]) return 0;
+        if (len > ar->stored_sizes[i] - offset)
+            len = ar->stored_sizes[i] - offset;
+        if (fseek(ar->fp, (long)(ar->offsets[i] + offset), SEEK_SET) == -1 ||
+            fread(buf, 1, len, ar->fp) != len)
+        {
+            perror("Read failed");
+            abort();
+        }
+        return len;
+
+    case COM_DEFLATE:
+        return pread_deflated(ar, i, buf, offset, len);
+
+    case COM_LZMA:
+        /* LZMA data has no access points; decode from the start */
+        seek_entry(ar, i);
+        return copy_lzmad_range(buf, len, offset, ar->fp,
+                                ar->stored_sizes[i]);
+
+    default:
+        return 0;
+    }
+}
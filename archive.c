@@ -0,0 +1,483 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/* Default value of decode_buffer_limit */
+#define DEFAULT_DECODE_BUFFER_LIMIT (1 << 20)
+
+/* Minimum size of entries decoded with decode_entry_pipelined() */
+#define PIPELINE_MIN_SIZE (16 << 20)
+
+static uint32_t read_uint32(FILE *fp)
+{
+    uint8_t bytes[4];
+
+    if (fread(bytes, 4, 1, fp) != 1)
+    {
+        perror("Read failed");
+        abort();
+    }
+
+    return ((uint32_t)bytes[0] <<  0) | ((uint32_t)bytes[1] <<  8) |
+           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void process_header(Archive *ar)
+{
+    if (read_uint32(ar->fp) != 0xac2ff34ful)
+    {
+        fprintf(stderr, "%s: the specified file does not seem to be a "
+                        "Hothead Archive file.\n", ar->path);
+        exit(1);
+    }
+    (void)read_uint32(ar->fp);
+    ar->strings_size = read_uint32(ar->fp);
+    ar->entries_size = read_uint32(ar->fp);
+    assert( ar->strings_size <= ar->file_size - sizeof(Header) );
+    assert( ar->entries_size <= (ar->file_size - ar->strings_size -
+                                 sizeof(Header)) / sizeof(IndexEntry) );
+
+    /* Allocate and read string table */
+    ar->strings = malloc(ar->strings_size + 1);
+    if (ar->strings == NULL)
+    {
+        perror("Could not allocate memory for string table");
+        abort();
+    }
+    if (fread(ar->strings, 1, ar->strings_size, ar->fp) != ar->strings_size)
+    {
+        perror("Could not read string table");
+        abort();
+    }
+    ar->strings[ar->strings_size] = '\0';   /* zero-terminate strings table */
+
+    /* Allocate and read index */
+    ar->entries = malloc(sizeof(IndexEntry)*ar->entries_size);
+    if (ar->entries == NULL && ar->entries_size > 0)
+    {
+        perror("Could not allocate memory for index");
+        abort();
+    }
+    if (fread(ar->entries, sizeof(IndexEntry), ar->entries_size, ar->fp)
+        != ar->entries_size)
+    {
+        perror("Could not read index entries");
+        abort();
+    }
+
+    ar->pos = sizeof(Header) + ar->strings_size +
+              sizeof(IndexEntry)*ar->entries_size;
+}
+
+/* Returns the length of the full path of entry i, or 0 if its names lie
+   outside the string table or the path would not fit in PATH_LEN. */
+static size_t path_length(const Archive *ar, size_t i)
+{
+    const IndexEntry *e = &ar->entries[i];
+    size_t len;
+
+    if (e->dir_name >= ar->strings_size || e->file_name >= ar->strings_size)
+        return 0;
+    len = strlen(ar->strings + e->dir_name);
+    len += (len > 0) + strlen(ar->strings + e->file_name);
+    return len < PATH_LEN ? len : 0;
+}
+
+/* Fills the per-field arrays of the index */
+static void build_columns(Archive *ar)
+{
+    const IndexEntry *e;
+    size_t i, n;
+
+    n = ar->entries_size;
+    ar->offsets      = malloc(sizeof(uint32_t)*n + 1);
+    ar->sizes        = malloc(sizeof(uint32_t)*n + 1);
+    ar->stored_sizes = malloc(sizeof(uint32_t)*n + 1);
+    ar->codecs       = malloc(n + 1);
+    if (ar->offsets == NULL || ar->sizes == NULL ||
+        ar->stored_sizes == NULL || ar->codecs == NULL)
+    {
+        perror("Could not allocate memory for index");
+        abort();
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        e = &ar->entries[i];
+        ar->offsets[i]      = e->offset;
+        ar->sizes[i]        = e->size;
+        ar->stored_sizes[i] = e->stored_size;
+        ar->codecs[i]       = e->compression < 255 ? e->compression : 255;
+    }
+}
+
+/* Returns whether the index is sorted by path, ignoring case. Entries with
+   empty paths (see load_paths()) make the index unsorted. */
+static int check_sorted(const Archive *ar)
+{
+    const char *path, *prev = NULL;
+    size_t i;
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        path = entry_full_path(ar, i);
+        if (*path == '\0') return 0;
+        if (prev != NULL && compare_strings(prev, path, 1) > 0) return 0;
+        prev = path;
+    }
+    return 1;
+}
+
+Archive *open_archive(const char *path)
+{
+    Archive *ar;
+    struct stat st;
+    long lpos;
+
+    ar = malloc(sizeof(Archive));
+    if (ar == NULL)
+    {
+        perror("Could not allocate memory for archive");
+        abort();
+    }
+    memset(ar, 0, sizeof(Archive));
+    ar->path = path;
+
+    /* Open file */
+    if (strcmp(path, "-") == 0)
+    {
+        ar->fp = stdin;
+#ifdef WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else
+    {
+        ar->fp = fopen(path, "rb");
+        if (ar->fp == NULL)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    /* Pipes and other special files are read sequentially */
+    ar->seekable = fstat(fileno(ar->fp), &st) == 0 && S_ISREG(st.st_mode);
+    if (!ar->seekable)
+    {
+        ar->file_size = (size_t)-1;
+    }
+    else
+    {
+        /* Seek to end to determine file size */
+        if (fseek(ar->fp, 0, SEEK_END) == -1 || (lpos = ftell(ar->fp)) == -1)
+        {
+            perror("Could not determine file size");
+            abort();
+        }
+        fseek(ar->fp, 0, SEEK_SET);
+        ar->file_size = (size_t)lpos;
+    }
+
+    process_header(ar);
+    load_lookup_index(ar);
+    load_access_points(ar);
+    build_columns(ar);
+    ar->checksums = read_checksums(ar);
+
+    return ar;
+}
+
+void close_archive(Archive *ar)
+{
+#ifndef WIN32
+    if (ar->data != NULL) munmap((void*)ar->data, ar->file_size);
+#endif
+    unload_lookup_index(ar);
+    unload_access_points(ar);
+    if (ar->fp != stdin) fclose(ar->fp);
+    free(ar->strings);
+    free(ar->entries);
+    free(ar->paths);
+    free(ar->path_pos);
+    free(ar->hashes);
+    free(ar->offsets);
+    free(ar->sizes);
+    free(ar->stored_sizes);
+    free(ar->codecs);
+    free(ar->checksums);
+    free(ar);
+}
+
+const char *strat(const Archive *ar, size_t pos)
+{
+    assert(pos <= ar->strings_size);
+    return ar->strings + pos;
+}
+
+void entry_path(const Archive *ar, size_t i, char path[PATH_LEN])
+{
+    const char *dir_name, *file_name;
+    size_t dir_len, file_len;
+
+    dir_name  = strat(ar, ar->entries[i].dir_name);
+    file_name = strat(ar, ar->entries[i].file_name);
+    dir_len   = strlen(dir_name);
+    file_len  = strlen(file_name);
+
+    assert(dir_len + 1 + file_len < PATH_LEN);
+    if (dir_len > 0)
+    {
+        memcpy(path, dir_name, dir_len);
+        path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, file_name, file_len + 1);
+}
+
+void load_paths(Archive *ar)
+{
+    size_t i, n, end, pool_size;
+
+    if (ar->paths != NULL) return;
+    n = ar->entries_size;
+    ar->path_pos = malloc(sizeof(size_t)*n + 1);
+    ar->hashes   = malloc(sizeof(uint32_t)*n + 1);
+    if (ar->path_pos == NULL || ar->hashes == NULL)
+    {
+        perror("Could not allocate memory for index");
+        abort();
+    }
+
+    /* Invalid paths (see path_length()) are left empty */
+    pool_size = 0;
+    for (i = 0; i < n; ++i)
+    {
+        ar->path_pos[i] = pool_size;
+        pool_size += path_length(ar, i) + 1;
+    }
+    ar->paths = malloc(pool_size + 1);
+    if (ar->paths == NULL)
+    {
+        perror("Could not allocate memory for index");
+        abort();
+    }
+    for (i = 0; i < n; ++i)
+    {
+        end = i + 1 < n ? ar->path_pos[i + 1] : pool_size;
+        if (end - ar->path_pos[i] > 1)
+            entry_path(ar, i, ar->paths + ar->path_pos[i]);
+        else
+            ar->paths[ar->path_pos[i]] = '\0';
+        ar->hashes[i] = hash_string(ar->paths + ar->path_pos[i], 1);
+    }
+    ar->sorted = check_sorted(ar);
+}
+
+const char *entry_full_path(const Archive *ar, size_t i)
+{
+    assert(ar->paths != NULL && i < ar->entries_size);
+    return ar->paths + ar->path_pos[i];
+}
+
+void seek_entry(Archive *ar, size_t i)
+{
+    assert(ar->seekable);
+    if (fseek(ar->fp, (long)ar->entries[i].offset, SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+}
+
+size_t decode_buffer_limit = DEFAULT_DECODE_BUFFER_LIMIT;
+
+size_t decode_entry_buffer(void *dst, const void *src, const IndexEntry *e)
+{
+    switch (e->compression)
+    {
+    case COM_NONE:
+        memcpy(dst, src, e->stored_size < e->size ? e->stored_size : e->size);
+        return e->stored_size < e->size ? e->stored_size : e->size;
+    case COM_DEFLATE:
+        return decode_deflated_buffer(dst, e->size, src, e->stored_size);
+    case COM_LZMA:
+        return decode_lzma_buffer(dst, e->size, src, e->stored_size);
+    default:
+        return 0;
+    }
+}
+
+size_t decode_entry_to_buffer(void *dst, FILE *src, const IndexEntry *e)
+{
+    size_t size;
+
+    switch (e->compression)
+    {
+    case COM_NONE:
+        size = e->stored_size < e->size ? e->stored_size : e->size;
+        if (fread(dst, 1, size, src) != size)
+        {
+            perror("Read failed");
+            abort();
+        }
+        skip_data(src, e->stored_size - size);
+        return size;
+    case COM_DEFLATE:
+        return copy_deflated_to_buffer(dst, e->size, src, e->stored_size);
+    case COM_LZMA:
+        return copy_lzmad_to_buffer(dst, e->size, src, e->stored_size);
+    default:
+        skip_data(src, e->stored_size);
+        return 0;
+    }
+}
+
+/* Decodes a compressed entry by reading all of its stored data at once,
+   decoding it in a single call, and writing the result at once. Returns
+   (size_t)-1 if the buffer could not be allocated. */
+static size_t decode_entry_at_once(FILE *dst, FILE *src, const IndexEntry *e)
+{
+    unsigned char *buf;
+    size_t size;
+
+    buf = malloc(e->stored_size + e->size);
+    if (buf == NULL) return (size_t)-1;
+    if (fread(buf, 1, e->stored_size, src) != e->stored_size)
+    {
+        perror("Read failed");
+        abort();
+    }
+    size = decode_entry_buffer(buf + e->stored_size, buf, e);
+    if (fwrite(buf + e->stored_size, 1, size, dst) != size)
+    {
+        perror("Write failed");
+        abort();
+    }
+    free(buf);
+    return size;
+}
+
+size_t decode_entry(FILE *dst, FILE *src, const IndexEntry *e)
+{
+    size_t size;
+
+    if ((e->compression == COM_DEFLATE || e->compression == COM_LZMA) &&
+        e->size <= decode_buffer_limit &&
+        e->stored_size <= decode_buffer_limit - e->size &&
+        (size = decode_entry_at_once(dst, src, e)) != (size_t)-1)
+    {
+        return size;
+    }
+
+    if (e->compression <= COM_LZMA && num_workers() > 1 &&
+        (e->size >= PIPELINE_MIN_SIZE || e->stored_size >= PIPELINE_MIN_SIZE))
+    {
+        return decode_entry_pipelined(dst, src, e);
+    }
+
+    return decode_entry_streaming(dst, src, e);
+}
+
+size_t decode_entry_streaming(FILE *dst, FILE *src, const IndexEntry *e)
+{
+    switch (e->compression)
+    {
+    case COM_NONE:    return copy_uncompressed(dst, src, e->stored_size);
+    case COM_DEFLATE: return copy_deflated(dst, src, e->stored_size);
+    case COM_LZMA:    return copy_lzmad(dst, src, e->stored_size);
+    default:          break;
+    }
+    skip_data(src, e->stored_size);
+    return 0;
+}
+
+int map_archive(Archive *ar)
+{
+#ifndef WIN32
+    void *data;
+
+    if (ar->data != NULL) return 1;
+    if (!ar->seekable || ar->file_size == 0 ||
+        (size_t)(off_t)ar->file_size != ar->file_size) return 0;
+
+    data = mmap(NULL, ar->file_size, PROT_READ, MAP_SHARED, fileno(ar->fp), 0);
+    if (data == MAP_FAILED) return 0;
+    ar->data = data;
+    return 1;
+#else
+    (void)ar;
+    return 0;
+#endif
+}
+
+const unsigned char *entry_data(const Archive *ar, size_t i)
+{
+    const IndexEntry *e = &ar->entries[i];
+
+    if (ar->data == NULL || e->offset > ar->file_size ||
+        e->stored_size > ar->file_size - e->offset) return NULL;
+    return ar->data + e->offset;
+}
+
+const unsigned char *entry_view(const Archive *ar, size_t i, size_t *size)
+{
+    const IndexEntry *e = &ar->entries[i];
+    const unsigned char *data;
+
+    if (e->compression != COM_NONE || (data = entry_data(ar, i)) == NULL)
+        return NULL;
+    *size = e->stored_size < e->size ? e->stored_size : e->size;
+    return data;
+}
+
+uint32_t checksum_entry(Archive *ar, size_t i)
+{
+    unsigned char buffer[4096];
+    const unsigned char *data;
+    size_t left, chunk;
+    uLong crc;
+
+    crc = crc32(0, Z_NULL, 0);
+    if (ar->data != NULL)
+    {
+        data = entry_data(ar, i);
+        if (data == NULL)
+        {
+            fprintf(stderr, "%s: entry %ld extends past end of file.\n",
+                            ar->path, (long)i);
+            abort();
+        }
+        for (left = ar->entries[i].stored_size; left > 0; left -= chunk)
+        {
+            chunk = left < 0x40000000 ? left : 0x40000000;
+            crc = crc32(crc, data, (uInt)chunk);
+            data += chunk;
+        }
+        return (uint32_t)crc;
+    }
+
+    seek_entry(ar, i);
+    for (left = ar->entries[i].stored_size; left > 0; left -= chunk)
+    {
+        chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        if (fread(buffer, 1, chunk, ar->fp) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        crc = crc32(crc, buffer, (uInt)chunk);
+    }
+    return (uint32_t)crc;
+}
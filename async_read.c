@@ -0,0 +1,397 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/* Requests for entries whose stored data lies at most this far apart are
+   served with a single read, up to a total of SPAN_MAX bytes. */
+#define SPAN_GAP (64 << 10)
+#define SPAN_MAX (4 << 20)
+
+struct ReadRequest
+{
+    size_t      entry;          /* Index of entry in the archive */
+    void        *buf;           /* Destination */
+    void        (*callback)(void *arg, size_t i, size_t size);
+    void        *arg;
+};
+
+struct Reader
+{
+    Archive     *ar;
+    FILE        **fp_in;        /* Archive file (per worker) */
+    int         workers;        /* Maximum number of workers */
+    int         started;        /* Workers started so far */
+
+    struct ReadRequest *pending;    /* Queued requests, by offset */
+    size_t      pending_size, pending_capacity;
+    size_t      busy;           /* Requests taken by workers */
+
+#ifndef WIN32
+    pthread_t   *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t  queued;     /* Signalled when requests are queued */
+    pthread_cond_t  idle;       /* Signalled when all requests are done */
+    int         waiting;        /* Workers waiting for requests */
+    int         stopping;
+#endif
+};
+
+/* Opens another handle to the archive file */
+static FILE *open_handle(const Archive *ar)
+{
+    FILE *fp;
+
+    fp = fopen(ar->path, "rb");
+    if (fp == NULL)
+    {
+        perror(ar->path);
+        exit(1);
+    }
+    return fp;
+}
+
+/* Reads the stored data of ``count'' requests, which must be sorted by
+   offset, with a single read (unless the archive is mapped), and decodes
+   it into the requests' buffers. */
+static void serve_requests( Reader *rd, FILE *fp_in,
+                            const struct ReadRequest *reqs, size_t count )
+{
+    const Archive *ar = rd->ar;
+    const unsigned char *span;
+    unsigned char *buf = NULL;
+    size_t k, i, begin, end, size;
+
+    begin = end = ar->offsets[reqs[0].entry];
+    for (k = 0; k < count; ++k)
+    {
+        i = reqs[k].entry;
+        if (ar->offsets[i] + ar->stored_sizes[i] > end)
+            end = ar->offsets[i] + ar->stored_sizes[i];
+    }
+
+    if (ar->data != NULL)
+    {
+        span = ar->data + begin;
+    }
+    else
+    {
+        buf = malloc(end - begin + 1);
+        if (buf == NULL)
+        {
+            perror("Could not allocate memory");
+            abort();
+        }
+        if (fseek(fp_in, (long)begin, SEEK_SET) == -1 ||
+            fread(buf, 1, end - begin, fp_in) != end - begin)
+        {
+            perror("Read failed");
+            abort();
+        }
+        span = buf;
+    }
+
+    for (k = 0; k < count; ++k)
+    {
+        i = reqs[k].entry;
+        size = decode_entry_buffer( reqs[k].buf, span + ar->offsets[i] - begin,
+                                    &ar->entries[i] );
+        if (reqs[k].callback != NULL)
+            reqs[k].callback(reqs[k].arg, i, size);
+    }
+    free(buf);
+}
+
+#ifndef WIN32
+
+/* Takes the first pending request, and those that follow it closely enough
+   to be read along with it, from the queue into ``reqs''. Returns the
+   number of requests taken. Must be called with the mutex locked. */
+static size_t take_requests(Reader *rd, struct ReadRequest *reqs)
+{
+    const Archive *ar = rd->ar;
+    size_t n, i, begin, end;
+
+    i     = rd->pending[0].entry;
+    begin = ar->offsets[i];
+    end   = begin + ar->stored_sizes[i];
+    for (n = 1; n < rd->pending_size; ++n)
+    {
+        i = rd->pending[n].entry;
+        if (ar->offsets[i] > end + SPAN_GAP ||
+            ar->offsets[i] + ar->stored_sizes[i] - begin > SPAN_MAX) break;
+        if (ar->offsets[i] + ar->stored_sizes[i] > end)
+            end = ar->offsets[i] + ar->stored_sizes[i];
+    }
+    memcpy(reqs, rd->pending, sizeof(struct ReadRequest)*n);
+    memmove(rd->pending, rd->pending + n,
+            sizeof(struct ReadRequest)*(rd->pending_size - n));
+    rd->pending_size -= n;
+    rd->busy += n;
+    return n;
+}
+
+struct ReaderWorker
+{
+    Reader      *rd;
+    int         id;
+};
+
+static void *reader_worker_main(void *arg)
+{
+    struct ReaderWorker *w = arg;
+    Reader *rd = w->rd;
+    struct ReadRequest *reqs;
+    size_t capacity = 0, count;
+
+    reqs = NULL;
+    pthread_mutex_lock(&rd->mutex);
+    for (;;)
+    {
+        rd->waiting++;
+        while (rd->pending_size == 0 && !rd->stopping)
+            pthread_cond_wait(&rd->queued, &rd->mutex);
+        rd->waiting--;
+        if (rd->pending_size == 0) break;
+
+        if (capacity < rd->pending_size)
+        {
+            capacity = rd->pending_size;
+            reqs = realloc(reqs, sizeof(struct ReadRequest)*capacity);
+            assert(reqs != NULL);
+        }
+        count = take_requests(rd, reqs);
+        pthread_mutex_unlock(&rd->mutex);
+
+        serve_requests(rd, rd->fp_in[w->id], reqs, count);
+
+        pthread_mutex_lock(&rd->mutex);
+        rd->busy -= count;
+        if (rd->busy == 0 && rd->pending_size == 0)
+            pthread_cond_broadcast(&rd->idle);
+    }
+    pthread_mutex_unlock(&rd->mutex);
+    free(reqs);
+    free(w);
+    return NULL;
+}
+
+/* Starts another worker, with its own handle to the archive. Must be called
+   with the mutex locked. */
+static void start_worker(Reader *rd)
+{
+    struct ReaderWorker *worker;
+
+    worker = malloc(sizeof(struct ReaderWorker));
+    assert(worker != NULL);
+    worker->rd = rd;
+    worker->id = rd->started;
+    rd->fp_in[worker->id] = open_handle(rd->ar);
+    if (pthread_create(&rd->threads[worker->id], NULL, reader_worker_main,
+                       worker) != 0)
+    {
+        perror("Could not create thread");
+        abort();
+    }
+    rd->started++;
+}
+
+#endif /* ndef WIN32 */
+
+Reader *open_reader(Archive *ar)
+{
+    Reader *rd;
+
+    assert(ar->seekable);
+    rd = malloc(sizeof(Reader));
+    assert(rd != NULL);
+    memset(rd, 0, sizeof(Reader));
+    rd->ar      = ar;
+    rd->workers = num_workers();
+    rd->fp_in   = calloc(rd->workers, sizeof(FILE*));
+    assert(rd->fp_in != NULL);
+
+    /* Workers are started as requests are queued */
+#ifndef WIN32
+    pthread_mutex_init(&rd->mutex, NULL);
+    pthread_cond_init(&rd->queued, NULL);
+    pthread_cond_init(&rd->idle, NULL);
+    rd->threads = malloc(sizeof(pthread_t)*rd->workers);
+    assert(rd->threads != NULL);
+#endif
+
+    return rd;
+}
+
+void read_entry_async( Reader *rd, size_t i, void *buf,
+                       void (*callback)(void *arg, size_t i, size_t size),
+                       void *arg )
+{
+    struct ReadRequest req;
+    const Archive *ar = rd->ar;
+#ifndef WIN32
+    size_t lo, hi, mid;
+#endif
+
+    assert(buf != NULL);
+    if (ar->offsets[i] > ar->file_size ||
+        ar->stored_sizes[i] > ar->file_size - ar->offsets[i])
+    {
+        /* Data lies outside the file */
+        if (callback != NULL) callback(arg, i, (size_t)-1);
+        return;
+    }
+    req.entry    = i;
+    req.buf      = buf;
+    req.callback = callback;
+    req.arg      = arg;
+
+#ifndef WIN32
+    /* Queue the request, keeping the queue sorted by offset. Requests for
+       the same offset are served in the order they were made. */
+    pthread_mutex_lock(&rd->mutex);
+    if (rd->pending_size == rd->pending_capacity)
+    {
+        rd->pending_capacity = rd->pending_capacity > 0 ?
+                               2*rd->pending_capacity : 64;
+        rd->pending = realloc(rd->pending,
+            sizeof(struct ReadRequest)*rd->pending_capacity);
+        assert(rd->pending != NULL);
+    }
+    for (lo = 0, hi = rd->pending_size; lo < hi; )
+    {
+        mid = lo + (hi - lo)/2;
+        if (ar->offsets[rd->pending[mid].entry] <= ar->offsets[i])
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    memmove(rd->pending + lo + 1, rd->pending + lo,
+            sizeof(struct ReadRequest)*(rd->pending_size - lo));
+    rd->pending[lo] = req;
+    rd->pending_size++;
+    if ((size_t)rd->waiting < rd->pending_size && rd->started < rd->workers)
+        start_worker(rd);
+    pthread_cond_signal(&rd->queued);
+    pthread_mutex_unlock(&rd->mutex);
+#else
+    /* Without threads, serve the request right away */
+    if (rd->fp_in[0] == NULL) rd->fp_in[0] = open_handle(ar);
+    serve_requests(rd, rd->fp_in[0], &req, 1);
+#endif
+}
+
+static const Archive *sort_ar;  /* Archive sorted by cmp_entry_offset() */
+
+static int cmp_entry_offset(const void *a, const void *b)
+{
+    size_t i = *(const size_t*)a, j = *(const size_t*)b;
+    const uint32_t *offsets = sort_ar->offsets;
+
+    if (offsets[i] != offsets[j]) return offsets[i] < offsets[j] ? -1 : 1;
+    return i < j ? -1 : i > j ? 1 : 0;
+}
+
+/* Advises the system that the ``size'' bytes of the archive file at
+   ``offset'' will be read soon. */
+static void advise_span(const Archive *ar, size_t offset, size_t size)
+{
+#ifndef WIN32
+    size_t page, begin;
+
+    if (ar->data != NULL)
+    {
+        page  = (size_t)sysconf(_SC_PAGESIZE);
+        begin = offset/page*page;
+        posix_madvise( (void*)(ar->data + begin), offset + size - begin,
+                       POSIX_MADV_WILLNEED );
+    }
+    else
+    {
+        posix_fadvise( fileno(ar->fp), (off_t)offset, (off_t)size,
+                       POSIX_FADV_WILLNEED );
+    }
+#else
+    (void)ar;
+    (void)offset;
+    (void)size;
+#endif
+}
+
+void prefetch_entries(Reader *rd, const size_t *entries, size_t count)
+{
+    const Archive *ar = rd->ar;
+    size_t *order, k, i, begin, end;
+
+    if (count == 0) return;
+    order = malloc(sizeof(size_t)*count);
+    assert(order != NULL);
+    memcpy(order, entries, sizeof(size_t)*count);
+    sort_ar = ar;
+    qsort(order, count, sizeof(size_t), cmp_entry_offset);
+
+    /* Advise spans of entries that lie close together at once */
+    begin = end = 0;
+    for (k = 0; k < count; ++k)
+    {
+        i = order[k];
+        if (ar->offsets[i] > ar->file_size ||
+            ar->stored_sizes[i] > ar->file_size - ar->offsets[i]) continue;
+        if (end > begin && (ar->offsets[i] > end + SPAN_GAP ||
+                            ar->offsets[i] + ar->stored_sizes[i] - begin >
+                            SPAN_MAX))
+        {
+            advise_span(ar, begin, end - begin);
+            begin = end = 0;
+        }
+        if (end == begin) begin = ar->offsets[i];
+        if (ar->offsets[i] + ar->stored_sizes[i] > end)
+            end = ar->offsets[i] + ar->stored_sizes[i];
+    }
+    if (end > begin) advise_span(ar, begin, end - begin);
+    free(order);
+}
+
+void wait_reader(Reader *rd)
+{
+#ifndef WIN32
+    pthread_mutex_lock(&rd->mutex);
+    while (rd->busy > 0 || rd->pending_size > 0)
+        pthread_cond_wait(&rd->idle, &rd->mutex);
+    pthread_mutex_unlock(&rd->mutex);
+#else
+    (void)rd;
+#endif
+}
+
+void close_reader(Reader *rd)
+{
+    int w;
+
+#ifndef WIN32
+    pthread_mutex_lock(&rd->mutex);
+    rd->stopping = 1;
+    pthread_cond_broadcast(&rd->queued);
+    pthread_mutex_unlock(&rd->mutex);
+    for (w = 0; w < rd->started; ++w) pthread_join(rd->threads[w], NULL);
+    pthread_cond_destroy(&rd->idle);
+    pthread_cond_destroy(&rd->queued);
+    pthread_mutex_destroy(&rd->mutex);
+    free(rd->threads);
+#endif
+    for (w = 0; w < rd->workers; ++w)
+    {
+        if (rd->fp_in[w] != NULL) fclose(rd->fp_in[w]);
+    }
+    free(rd->fp_in);
+    free(rd->pending);
+    free(rd);
+}
@@ -0,0 +1,119 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Magic number at the end of the checksum table ("HHAC") */
+#define CHECKSUMS_MAGIC 0x43414848ul
+
+/* Size of the table footer: number of entries and magic number */
+#define FOOTER_SIZE 8
+
+EntryChecksums *read_checksums(Archive *ar)
+{
+    EntryChecksums *sums;
+    unsigned char footer[FOOTER_SIZE], *table;
+    size_t i, table_size, table_pos, data_end, end;
+
+    if (!ar->seekable || ar->file_size < ar->pos + FOOTER_SIZE) return NULL;
+    table_size = 8*ar->entries_size;
+    if (ar->file_size - ar->pos - FOOTER_SIZE < table_size) return NULL;
+    table_pos = ar->file_size - FOOTER_SIZE - table_size;
+
+    /* The table must follow the data of all entries */
+    data_end = ar->pos;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        end = (size_t)ar->offsets[i] + ar->stored_sizes[i];
+        data_end = end > data_end ? end : data_end;
+    }
+    if (data_end > table_pos) return NULL;
+
+    if (fseek(ar->fp, (long)(table_pos + table_size), SEEK_SET) == -1 ||
+        fread(footer, 1, FOOTER_SIZE, ar->fp) != FOOTER_SIZE)
+    {
+        perror("Could not read checksums");
+        abort();
+    }
+    sums = NULL;
+    if (get_uint32(footer + 4) == CHECKSUMS_MAGIC &&
+        get_uint32(footer) == ar->entries_size)
+    {
+        table = malloc(table_size + 1);
+        sums  = malloc(sizeof(EntryChecksums)*ar->entries_size + 1);
+        if (table == NULL || sums == NULL)
+        {
+            perror("Could not allocate memory for checksums");
+            abort();
+        }
+        if (fseek(ar->fp, (long)table_pos, SEEK_SET) == -1 ||
+            fread(table, 1, table_size, ar->fp) != table_size)
+        {
+            perror("Could not read checksums");
+            abort();
+        }
+        for (i = 0; i < ar->entries_size; ++i)
+        {
+            sums[i].stored  = get_uint32(table + 8*i);
+            sums[i].decoded = get_uint32(table + 8*i + 4);
+        }
+        free(table);
+    }
+
+    if (fseek(ar->fp, (long)ar->pos, SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+    return sums;
+}
+
+size_t compute_checksums( EntryChecksums *sums, const void *data,
+                          const IndexEntry *e )
+{
+    unsigned char *buf;
+    size_t size;
+
+    sums->stored = crc32c(0, data, e->stored_size);
+    if (e->compression == COM_NONE && e->stored_size == e->size)
+    {
+        sums->decoded = sums->stored;
+        return e->size;
+    }
+
+    buf = malloc(e->size + 1);
+    if (buf == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    size = decode_entry_buffer(buf, data, e);
+    sums->decoded = crc32c(0, buf, size);
+    free(buf);
+    return size;
+}
+
+size_t write_checksums( FILE *fp, const EntryChecksums *sums,
+                        size_t entries_size )
+{
+    unsigned char buf[8];
+    size_t i;
+
+    for (i = 0; i < entries_size; ++i)
+    {
+        put_uint32(buf,     sums[i].stored);
+        put_uint32(buf + 4, sums[i].decoded);
+        if (fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf))
+        {
+            perror("Could not write checksums");
+            abort();
+        }
+    }
+    put_uint32(buf,     (uint32_t)entries_size);
+    put_uint32(buf + 4, CHECKSUMS_MAGIC);
+    if (fwrite(buf, 1, FOOTER_SIZE, fp) != FOOTER_SIZE)
+    {
+        perror("Could not write checksums");
+        abort();
+    }
+    return 8*entries_size + FOOTER_SIZE;
+}
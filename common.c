@@ -1,6 +1,18 @@
+#define _GNU_SOURCE     /* for copy_file_range() */
 #include "common.h"
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+/* Minimum size of data copied with copy_file_range(). Smaller copies are
+   cheaper to do through the stdio buffers. */
+#define COPY_FILE_RANGE_MIN 65536
 
 size_t copy_uncompressed(FILE *dst, FILE *src, size_t size_in)
 {
@@ -16,7 +28,7 @@ size_t copy_uncompressed(FILE *dst, FILE *src, size_t size_in)
             perror("Read failed");
             abort();
         }
-        if (fwrite(buffer, 1, chunk, dst) != chunk)
+        if (dst != NULL && fwrite(buffer, 1, chunk, dst) != chunk)
         {
             perror("Write failed");
             abort();
@@ -27,3 +39,168 @@ size_t copy_uncompressed(FILE *dst, FILE *src, size_t size_in)
 
     return size_out;
 }
+
+size_t copy_raw(FILE *dst, FILE *src, size_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    long pos_in, pos_out;
+    loff_t off_in, off_out;
+    ssize_t res;
+    size_t left;
+
+    if (size >= COPY_FILE_RANGE_MIN && (pos_in = ftell(src)) != -1 &&
+        fflush(dst) == 0 && (pos_out = ftell(dst)) != -1)
+    {
+        /* Let the kernel copy the data (possibly without copying at all,
+           if the file system supports sharing extents between files). */
+        off_in  = pos_in;
+        off_out = pos_out;
+        left    = size;
+        while (left > 0 && (res = copy_file_range( fileno(src), &off_in,
+                                fileno(dst), &off_out, left, 0 )) > 0)
+        {
+            left -= (size_t)res;
+        }
+        if (left < size)
+        {
+            /* Synchronize stdio streams with the new file offsets */
+            if (fseek(src, (long)off_in, SEEK_SET) != 0 ||
+                fseek(dst, (long)off_out, SEEK_SET) != 0)
+            {
+                perror("Seek failed");
+                abort();
+            }
+            return size - left + copy_uncompressed(dst, src, left);
+        }
+    }
+#endif
+    return copy_uncompressed(dst, src, size);
+}
+
+uint16_t get_uint16(const unsigned char *buf)
+{
+    return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+uint32_t get_uint32(const unsigned char *buf)
+{
+    return ((uint32_t)buf[0] <<  0) | ((uint32_t)buf[1] <<  8) |
+           ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void put_uint16(unsigned char *buf, uint16_t value)
+{
+    buf[0] = (unsigned char)(value >> 0);
+    buf[1] = (unsigned char)(value >> 8);
+}
+
+void put_uint32(unsigned char *buf, uint32_t value)
+{
+    buf[0] = (unsigned char)(value >>  0);
+    buf[1] = (unsigned char)(value >>  8);
+    buf[2] = (unsigned char)(value >> 16);
+    buf[3] = (unsigned char)(value >> 24);
+}
+
+size_t skip_data(FILE *src, size_t size_in)
+{
+    char buffer[4096];
+    size_t chunk, size_out;
+
+    if (size_in == 0) return 0;
+
+    /* Seek forward if possible; otherwise, read and discard data. */
+    if ((long)size_in >= 0 && fseek(src, (long)size_in, SEEK_CUR) == 0)
+    {
+        return size_in;
+    }
+
+    size_out = 0;
+    while (size_in > 0)
+    {
+        chunk = size_in > sizeof(buffer) ? sizeof(buffer) : size_in;
+        if (fread(buffer, 1, chunk, src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        size_in  -= chunk;
+        size_out += chunk;
+    }
+
+    return size_out;
+}
+
+int is_safe_path(const char *path)
+{
+    const char *p;
+
+    if (path[0] == '/' || path[0] == '\0') return 0;
+    for (p = path; *p != '\0'; p = *p == '/' ? p + 1 : p)
+    {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+        {
+            return 0;
+        }
+        while (*p != '/' && *p != '\0') ++p;
+    }
+    return 1;
+}
+
+int match_pattern(const char *pattern, const char *path)
+{
+    const char *star_pattern = NULL, *star_path = NULL;
+
+    while (*path != '\0')
+    {
+        if (*pattern == '*')
+        {
+            /* Try to match an empty sequence first; backtrack later. */
+            star_pattern = ++pattern;
+            star_path    = path;
+        }
+        else
+        if (*pattern == '?' ||
+            tolower((unsigned char)*pattern) == tolower((unsigned char)*path))
+        {
+            ++pattern;
+            ++path;
+        }
+        else
+        if (star_pattern != NULL)
+        {
+            pattern = star_pattern;
+            path    = ++star_path;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while (*pattern == '*') ++pattern;
+    return *pattern == '\0';
+}
+
+int match_patterns( const char * const *patterns_begin,
+                    const char * const *patterns_end, const char *path )
+{
+    const char * const *p;
+    int selected = 1;
+
+    for (p = patterns_begin; p != patterns_end; ++p)
+    {
+        if ((*p)[0] != '!') selected = 0;
+    }
+    for (p = patterns_begin; p != patterns_end; ++p)
+    {
+        if ((*p)[0] == '!')
+        {
+            if (match_pattern(*p + 1, path)) return 0;
+        }
+        else
+        {
+            if (match_pattern(*p, path)) selected = 1;
+        }
+    }
+    return selected;
+}
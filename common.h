@@ -38,11 +38,86 @@ typedef struct Header Header;
 typedef struct IndexEntry IndexEntry;
 typedef enum Compression Compression;
 
+#define PATH_LEN 1024
+
+/* CRC-32C checksums of the stored and decoded data of an entry */
+struct EntryChecksums
+{
+    uint32_t    stored;
+    uint32_t    decoded;
+};
+
+typedef struct EntryChecksums EntryChecksums;
+
+/* An archive opened for reading */
+struct Archive
+{
+    const char  *path;          /* Path to archive file */
+    FILE        *fp;            /* File pointer */
+    size_t      file_size;      /* Size of file ((size_t)-1 if unknown) */
+    int         seekable;       /* Whether fp supports seeking */
+    size_t      pos;            /* Current position (if not seekable) */
+
+    char        *strings;       /* String table (zero-terminated) */
+    size_t      strings_size;   /* Size of string table */
+
+    IndexEntry  *entries;       /* Index entries */
+    size_t      entries_size;   /* Number of index entries */
+    int         sorted;         /* Whether entries are sorted by path */
+
+    /* The index as separate arrays, for scans over many entries. The paths,
+       their hashes and ``sorted'' are only set by load_paths(). */
+    char        *paths;         /* Full paths of entries, zero-terminated */
+    size_t      *path_pos;      /* Position of each entry's path in paths */
+    uint32_t    *hashes;        /* hash_string(path, 1) of each entry */
+    uint32_t    *offsets;       /* Offsets of stored data */
+    uint32_t    *sizes;         /* Decoded sizes */
+    uint32_t    *stored_sizes;  /* Stored sizes */
+    uint8_t     *codecs;        /* Compression methods (255 if larger) */
+
+    const unsigned char *data;  /* Memory-mapped file (see map_archive()) */
+    EntryChecksums *checksums;  /* Checksums per entry (NULL if absent) */
+
+    const unsigned char *lookup;    /* Lookup index (NULL if absent) */
+    size_t      lookup_size;
+    const unsigned char *points;    /* Access points (NULL if absent) */
+    size_t      points_size;
+};
+
+typedef struct Archive Archive;
+typedef struct HashTable HashTable;
+
+/* A stack of archives, where entries in later archives replace entries with
+   the same path (ignoring case) in earlier archives. */
+struct OverlayEntry
+{
+    Archive     *ar;            /* Archive containing the entry */
+    size_t      entry;          /* Index of entry in the archive */
+};
+
+struct Overlay
+{
+    Archive     **archives;     /* Archives in order of increasing priority */
+    size_t      archives_size;
+
+    struct OverlayEntry *entries;   /* Resolved entries */
+    size_t      entries_size;
+
+    HashTable   *paths;         /* Maps paths to indices into entries */
+};
+
+typedef struct OverlayEntry OverlayEntry;
+typedef struct Overlay Overlay;
+
 
 /* Compression/decompression functions
 
    Convert the first ``size'' bytes from src writing the result into ``dst''.
-   The number of bytes written is returned.
+   The number of bytes written is returned. Exactly ``size'' bytes are
+   consumed from src, even if the compressed data ends prematurely or turns
+   out to be corrupt, so callers reading an archive sequentially stay in sync.
+   The decoders (but not the compressors) accept a NULL dst to discard the
+   decoded data.
 */
 size_t copy_uncompressed(FILE *dst, FILE *src, size_t size);
 size_t copy_deflated(FILE *dst, FILE *src, size_t size);
@@ -50,11 +125,551 @@ size_t copy_deflatec(FILE *dst, FILE *src, size_t size);
 size_t copy_lzmad(FILE *dst, FILE *src, size_t size);
 size_t copy_lzmac(FILE *dst, FILE *src, size_t size);
 
-/* Archive creation */
+/* Decodes data in the .lzma file format, which (unlike archive entries
+   created with lzma_omit_uncompressed_size set) always includes the
+   uncompressed size, though it may be unknown. If dst is NULL, the decoded
+   data is discarded. */
+size_t copy_lzmad_alone(FILE *dst, FILE *src, size_t size);
+
+/* In-memory decompression
+
+   Decode ``src_size'' bytes of compressed data at src into the buffer of
+   ``dst_size'' bytes at dst, in a single call to the decoder. Returns the
+   number of bytes decoded, which is less than dst_size only if the data is
+   corrupt. */
+size_t decode_deflated_buffer( void *dst, size_t dst_size,
+                               const void *src, size_t src_size );
+size_t decode_lzma_buffer( void *dst, size_t dst_size,
+                           const void *src, size_t src_size );
+
+/* Tries to decode the ``src_size'' bytes of LZMA data at src, taking its
+   header to include the uncompressed size if has_size is nonzero, without
+   printing warnings. Returns 2 if exactly ``size'' bytes are decoded using
+   all of the data, 1 if ``size'' bytes are decoded but data is left over,
+   or 0 if decoding fails. */
+int check_lzma_buffer( const void *src, size_t src_size, size_t size,
+                       int has_size );
+
+/* Like copy_deflated() and copy_lzmad(), but decode into the buffer of
+   ``dst_size'' bytes at dst. The LZMA decoder uses the buffer itself as its
+   dictionary, so decoded data is not copied at all. */
+size_t copy_deflated_to_buffer(void *dst, size_t dst_size, FILE *src,
+                               size_t size);
+size_t copy_lzmad_to_buffer(void *dst, size_t dst_size, FILE *src,
+                            size_t size);
+
+/* Decodes LZMA data from src like copy_lzmad(), but discards the first
+   ``skip'' decoded bytes through a fixed-size scratch buffer and stores
+   the next ``dst_size'' bytes at dst, reading only as much data as that
+   takes. Returns the number of bytes stored. */
+size_t copy_lzmad_range( void *dst, size_t dst_size, size_t skip,
+                         FILE *src, size_t size );
+
+/* Decodes deflated data without writing it, storing the CRC-32 of the
+   decoded data in *crc. Returns the decoded size. */
+size_t crc_deflated(FILE *src, size_t size, uint32_t *crc);
+
+/* Decodes a deflate stream that starts at the current position of src
+   without writing it, reading at most ``size'' bytes. Returns the number of
+   bytes up to the end of the stream (which is where src is left, give or
+   take buffering) and stores the decoded size in *size_out. */
+size_t measure_deflated(FILE *src, size_t size, size_t *size_out);
+
+/* Random access into deflated data (zran-style access points)
+
+   find_deflate_points() decodes ``size'' bytes of deflated data from src
+   and calls point(arg, decoded, stored, bits, window) at block boundaries
+   that lie at least ``span'' (at least DEFLATE_WINDOW) decoded bytes apart.
+   Decoding can resume there: the first ``bits'' bits of the next block are
+   the high bits of stored byte ``stored'' - 1, and decoding continues with
+   stored byte ``stored'' and the last DEFLATE_WINDOW decoded bytes in
+   ``window'' as its dictionary.
+
+   inflate_from() resumes decoding at such a point (or at the start of the
+   data, if window is NULL and bits is 0) with src positioned at the stored
+   byte before the point if bits > 0, or at the point itself otherwise,
+   with ``size'' bytes of data left. It discards the first ``skip'' decoded
+   bytes, and stores the next ``dst_size'' bytes at dst, reading only as
+   much data as that takes. Returns the number of bytes stored. */
+#define DEFLATE_WINDOW 32768
+void find_deflate_points( FILE *src, size_t size, size_t span,
+                          void (*point)(void *arg, size_t decoded,
+                                        size_t stored, int bits,
+                                        const unsigned char *window),
+                          void *arg );
+size_t inflate_from( void *dst, size_t dst_size, size_t skip, FILE *src,
+                     size_t size, int bits, const unsigned char *window );
+
+/* Updates the CRC-32C ``crc'' (initially 0) with ``size'' bytes at data,
+   using the SSE4.2 crc32 instruction if the processor supports it
+   (crc32c.c). */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+/* Copies ``size'' bytes from src to dst, like copy_uncompressed(), but
+   uses copy_file_range() where possible to avoid copying through user
+   space. Both files must be seekable. */
+size_t copy_raw(FILE *dst, FILE *src, size_t size);
+
+/* Little-endian integer encoding */
+uint16_t get_uint16(const unsigned char *buf);
+uint32_t get_uint32(const unsigned char *buf);
+void put_uint16(unsigned char *buf, uint16_t value);
+void put_uint32(unsigned char *buf, uint32_t value);
+
+/* Skips the next ``size'' bytes of src (which need not be seekable).
+   Returns the number of bytes skipped. */
+size_t skip_data(FILE *src, size_t size);
+
+/* Archive reading (archive.c)
+
+   open_archive() reads the header, string table and index of the archive
+   at ``path'' (or standard input, if path is "-") and exits with an error
+   message if the file cannot be opened or is not a valid archive. It also
+   checks whether the index is sorted by path, ignoring case (see
+   sort_index), which allows entries to be found by binary search.
+   Besides the packed index entries, the archive keeps each field in an
+   array of its own, and the full paths of all entries in a single string
+   pool with their hashes, so loops over all entries touch only the data
+   they need. */
+Archive *open_archive(const char *path);
+void close_archive(Archive *ar);
+const char *strat(const Archive *ar, size_t pos);
+
+/* Stores the full path (directory/file) of entry i in ``path''. As an hha
+   convention (not part of the game's format), an empty directory name
+   stands for the root directory, and the path is just the file name. */
+void entry_path(const Archive *ar, size_t i, char path[PATH_LEN]);
+
+/* load_paths() builds the archive's path pool, the hash of each path and
+   the ``sorted'' flag, if it has not done so yet. open_archive() leaves
+   this to the operations that visit many paths, so that looking up a single
+   file does not pay for it. entry_full_path() returns the full path of
+   entry i from the pool, which must have been built. The path is empty if
+   the entry's names lie outside the string table. */
+void load_paths(Archive *ar);
+const char *entry_full_path(const Archive *ar, size_t i);
+
+/* Seeks to the data of entry i. The archive must be seekable. */
+void seek_entry(Archive *ar, size_t i);
+
+/* Maps the archive file into memory, if possible. Returns nonzero if the
+   archive is mapped (in which case ar->data points to the file contents).
+   Reading entries through the mapping is safe from multiple threads. */
+int map_archive(Archive *ar);
+
+/* Returns a pointer to the stored data of entry i in a mapped archive, or
+   NULL if the archive is not mapped or the entry lies outside the file. */
+const unsigned char *entry_data(const Archive *ar, size_t i);
+
+/* Returns a pointer to the contents of entry i in a mapped archive, and
+   stores their size in *size, if the entry is stored uncompressed. The
+   data is borrowed from the mapping and remains valid until the archive is
+   closed. Returns NULL if the entry is compressed, or if entry_data()
+   would return NULL. */
+const unsigned char *entry_view(const Archive *ar, size_t i, size_t *size);
+
+/* Returns the CRC-32 of the stored (compressed) data of entry i. This is
+   safe to call from multiple threads only if the archive is mapped. */
+uint32_t checksum_entry(Archive *ar, size_t i);
+
+/* Sidecar files (lookup_index.c)
+
+   Indices of an archive are kept in files next to it, named like the
+   archive with extension ``ext'' instead of .hha (see sidecar_path()).
+   They start with a stamp of the archive's size, modification time and
+   inode number and a checksum of its string table and index, obtained with
+   archive_stamp(), and are ignored if it does not match. The checksum
+   catches archives rewritten within the same second. archive_stamp()
+   returns 0 if the archive is not a regular file.
+
+   write_sidecar() replaces the file atomically, so processes that have the
+   old file mapped are not affected. map_sidecar() maps a file into memory
+   (or reads it, where mapping is not supported) and stores its size in
+   *size; it returns NULL if the file does not exist or is empty. */
+#define SIDECAR_STAMP_SIZE 24
+void sidecar_path( const char *archive_path, const char *ext,
+                   char path[PATH_LEN] );
+int archive_stamp(const Archive *ar, unsigned char stamp[SIDECAR_STAMP_SIZE]);
+void write_sidecar(const char *path, const void *data, size_t size);
+const unsigned char *map_sidecar(const char *path, size_t *size);
+void unmap_sidecar(const unsigned char *data, size_t size);
+
+/* Lookup indices (lookup_index.c)
+
+   A lookup index is a file next to an archive (with extension .hhx instead
+   of .hha) holding a hash table of the archive's paths, ignoring case,
+   which is mapped into memory and used as-is. It is ignored if it does not
+   match the archive (see archive_stamp()).
+   open_archive() loads the index with load_lookup_index(), if it exists.
+
+   lookup_entry() returns the last entry with the given path (ignoring
+   case), or (size_t)-1 if there is none; without an index, it uses binary
+   search if the archive is sorted, or else scans all entries, which is
+   still cheaper than building a hash table for a single lookup.
+
+   If the archive is sorted, prefix_range() stores in [*begin, *end) the
+   range of entries whose paths start with ``prefix'' (ignoring case) and
+   returns nonzero; otherwise, it returns 0. */
+void write_lookup_index(const char *archive_path);
+void load_lookup_index(Archive *ar);
+void unload_lookup_index(Archive *ar);
+size_t lookup_entry(Archive *ar, const char *path);
+int prefix_range( Archive *ar, const char *prefix,
+                  size_t *begin, size_t *end );
+
+/* Access points (access_points.c)
+
+   An access point file (with extension .hhp) holds zran-style access
+   points for deflated entries: positions at least access_span decoded
+   bytes apart where decoding can resume, each with the preceding 32 KiB
+   of decoded data. write_access_points() writes the file for an archive
+   (or removes it, if no entry is large enough to need access points), and
+   open_archive() loads it with load_access_points(), if it matches.
+
+   pread_entry() stores up to ``len'' bytes of the decoded data of entry i,
+   starting at ``offset'', in buf, and returns the number of bytes stored.
+   Deflated entries are decoded from the nearest access point before
+   offset, so the cost does not grow with the offset; LZMA compressed
+   entries are decoded from the start, discarding data before offset. This
+   moves the file position of the archive, so it is not safe to call from
+   multiple threads. */
+extern size_t access_span;
+void write_access_points(const char *archive_path);
+void load_access_points(Archive *ar);
+void unload_access_points(Archive *ar);
+size_t pread_entry( Archive *ar, size_t i, void *buf,
+                    size_t offset, size_t len );
+
+/* Entry checksums (checksums.c)
+
+   An archive may end with a table of checksums of all entries, which the
+   game ignores (see FORMAT.txt). open_archive() loads it into
+   ar->checksums if the archive is seekable. compute_checksums() calculates
+   the checksums of entry ``e'' from its stored data at ``data'' and returns
+   the decoded size. write_checksums() writes the table at the current
+   position of fp and returns its size in bytes. */
+EntryChecksums *read_checksums(Archive *ar);
+size_t compute_checksums( EntryChecksums *sums, const void *data,
+                          const IndexEntry *e );
+size_t write_checksums( FILE *fp, const EntryChecksums *sums,
+                        size_t entries_size );
+
+/* Decodes the data of entry ``e'' from src, writing it to dst. Returns the
+   number of bytes written, which should equal e->size. Compressed entries
+   whose stored and decoded data together fit in decode_buffer_limit bytes
+   are read, decoded and written at once instead of in small pieces, and
+   very large entries are decoded with decode_entry_pipelined() if multiple
+   threads may be used. decode_entry_streaming() always reads, decodes and
+   writes in small pieces on the calling thread, and accepts a NULL dst to
+   discard the decoded data. */
+extern size_t decode_buffer_limit;
+size_t decode_entry(FILE *dst, FILE *src, const IndexEntry *e);
+size_t decode_entry_streaming(FILE *dst, FILE *src, const IndexEntry *e);
+
+/* Decodes an entry like decode_entry_streaming(), but with a reader thread
+   reading stored data ahead in large blocks and a writer thread writing
+   decoded data in large blocks, so that I/O overlaps decoding (pipeline.c).
+   Blocks are double-buffered in memory; the decoder works on them
+   directly. Uncompressed entries have no decoder: the calling thread
+   writes the reader's blocks as they are, so reading overlaps writing. */
+size_t decode_entry_pipelined(FILE *dst, FILE *src, const IndexEntry *e);
+
+/* Decodes the ``e->stored_size'' bytes of entry data at src into the
+   ``e->size'' bytes at dst. Returns the number of bytes decoded. */
+size_t decode_entry_buffer(void *dst, const void *src, const IndexEntry *e);
+
+/* Decodes the data of entry ``e'' from src into the ``e->size'' bytes at
+   dst. Returns the number of bytes decoded. */
+size_t decode_entry_to_buffer(void *dst, FILE *src, const IndexEntry *e);
+
+/* Output files (output_file.c)
+
+   extract_file() creates the file at ``path'' and writes the decoded data
+   of entry ``e'', read from the current position of src, to it. Returns the
+   number of bytes written, or (size_t)-1 if the file could not be created,
+   in which case the entry's data is skipped.
+
+   With OUTPUT_MAPPED set in output_flags, the file is first allocated at
+   its final size and mapped into memory, and the data is decoded straight
+   into the mapping (using stdio instead if that fails). With
+   OUTPUT_DROP_CACHE set, written data and the entry's data in src are
+   dropped from the page cache afterwards. */
+#define OUTPUT_MAPPED       1
+#define OUTPUT_DROP_CACHE   2
+extern int output_flags;
+size_t extract_file(const char *path, FILE *src, const IndexEntry *e);
+
+/* Archive writing (create_archive.c)
+
+   These functions share global state, so only one archive can be written
+   at a time. An archive is written by calling begin_archive(), adding all
+   entries to the index, calling write_index() and then writing the data
+   for each entry, in order, followed by end_archive().
+
+   If the output is not a regular file, the entry data is written to a
+   spool file, and end_archive() writes the header and index followed by
+   the spooled data strictly forward; write_index() then does nothing.
+   begin_spooled_archive() always writes an archive this way, so entries
+   can be added after data has been written, up until end_archive().
+
+   write_entry() compresses the entry's data read from src (which must be
+   seekable) while write_entry_raw() copies already-compressed data.
+   Alternatively, stored data may be written in pieces by calling
+   begin_entry(), then write_entry_bytes() and copy_entry_bytes() any
+   number of times, and finally end_entry().
+
+   add_string() always appends a new string to the string table, while
+   intern_string() reuses an existing copy added by intern_string().
+
+   If add_checksums is nonzero, end_archive() appends the checksums of all
+   entries to the archive. If sort_index is nonzero, write_index() writes
+   the index sorted by path (ignoring case); data is still written in the
+   order entries were added, and entry numbers passed to these functions
+   keep referring to that order. Entries are aligned to 16 bytes, except
+   that uncompressed entries are aligned to store_alignment (a power of two
+   of at least 16), so they can be used in place through entry_view(). */
+extern FILE *fp_msg;    /* Progress messages (stderr if writing to stdout) */
+extern int add_checksums;
+extern int sort_index;
+extern size_t store_alignment;
+void begin_archive(const char *archive_path);
+void begin_spooled_archive(const char *archive_path);
+uint32_t add_string(const char *str);
+void add_strings(const char *data, size_t size);
+size_t add_entry( uint32_t dir_name, uint32_t file_name,
+                  Compression com, size_t size, size_t stored_size );
+size_t alloc_entry( const char *dir, const char *file,
+                    Compression com, size_t size, size_t stored_size );
+uint32_t intern_string(const char *str);
+void write_index();
+size_t write_entry(size_t i, FILE *src, Compression max_com);
+void write_entry_raw(size_t i, FILE *src, Compression com, size_t stored_size);
+void begin_entry(size_t i, Compression com);
+void write_entry_bytes(const void *data, size_t size);
+void copy_entry_bytes(FILE *src, size_t size);
+void end_entry(size_t i);
+void end_archive();
+
+/* Compresses ``size'' bytes from src to the current position in dst, using
+   the compression method no greater than *max_com that produces the
+   smallest output, which is stored in *max_com. Both files must be
+   seekable. Returns the number of bytes written. */
+size_t compress_data(FILE *dst, FILE *src, size_t size, Compression *max_com);
+
+/* Returns whether a path read from an external source (e.g. a ZIP or tar
+   file) is safe to extract: it must be relative and must not refer to a
+   parent directory. */
+int is_safe_path(const char *path);
+
+/* Returns whether ``path'' matches the wildcard ``pattern'', ignoring case.
+   In the pattern, `*' matches any sequence of characters (including `/')
+   and `?' matches any single character. */
+int match_pattern(const char *pattern, const char *path);
+
+/* Returns whether ``path'' is selected by a list of patterns: it must match
+   at least one pattern, and no pattern prefixed with `!'. If all patterns
+   are prefixed with `!', any path not excluded is selected. */
+int match_patterns( const char * const *patterns_begin,
+                    const char * const *patterns_end, const char *path );
+
+/* Hash tables mapping strings to values (hash_table.c)
+
+   Keys are copied into the table. If ``ignore_case'' is nonzero, keys that
+   differ only in case are considered equal (as paths in archives are).
+   hash_lookup() returns the value associated with key, or (size_t)-1 if
+   there is none. hash_insert() associates a value with a key, replacing
+   the old value, which is returned (or (size_t)-1 if there was none).
+   compare_prefix() compares at most ``len'' characters, like strncmp().
+   Case is folded for ASCII letters only, independent of the locale.
+   hash_lookup_hashed() and hash_insert_hashed() take a precomputed hash,
+   which must equal hash_string(key, ignore_case). */
+uint32_t hash_string(const char *str, int ignore_case);
+int compare_strings(const char *a, const char *b, int ignore_case);
+int compare_prefix(const char *a, const char *b, size_t len, int ignore_case);
+HashTable *create_hash_table(int ignore_case);
+void free_hash_table(HashTable *ht);
+size_t hash_lookup(const HashTable *ht, const char *key);
+size_t hash_insert(HashTable *ht, const char *key, size_t value);
+size_t hash_lookup_hashed(const HashTable *ht, const char *key, uint32_t hash);
+size_t hash_insert_hashed( HashTable *ht, const char *key, uint32_t hash,
+                           size_t value );
+
+/* Archive overlays (overlay.c)
+
+   create_overlay() combines archives already opened; free_overlay() frees
+   the overlay but leaves the archives open. open_overlay() opens archives
+   by path; close_overlay() closes them too. Resolved entries keep the index
+   position of the first archive containing the path. find_entry() returns
+   the entry for a path (ignoring case), or NULL if there is none.
+
+   open_archives() opens the archives without combining them.
+   lookup_overlay_entry() finds the entry an overlay of them would resolve
+   a path to, using lookup_entry() on each archive from last to first, so
+   lookup indices are used and no hash table of all paths is built. It
+   returns 0 if no archive contains the path. */
+Overlay *create_overlay(Archive **archives, size_t archives_size);
+void free_overlay(Overlay *ov);
+Archive **open_archives( const char * const *paths_begin,
+                         const char * const *paths_end );
+Overlay *open_overlay( const char * const *paths_begin,
+                       const char * const *paths_end );
+void close_overlay(Overlay *ov);
+const OverlayEntry *find_entry(const Overlay *ov, const char *path);
+int lookup_overlay_entry( Archive **archives, size_t archives_size,
+                          const char *path, OverlayEntry *oe );
+
+/* Archive creation
+
+   create_archive() adds the files in the given directories and containers
+   to a new archive; containers[k] is nonzero if dirs_begin[k] is a
+   container (a regular file for which is_container() holds) rather than a
+   directory. */
 void create_archive( const char *archive_path,
                      const char * const *dirs_begin,
                      const char * const *dirs_end,
-                     Compression com );
+                     const char *containers, Compression com );
+
+/* Tar streams (tar_archive.c)
+
+   create_archive_from_tar() creates an archive from the regular files in a
+   tar file (or standard input, if tar_path is "-"), which is read strictly
+   sequentially. Files are compressed in parallel as they arrive, and the
+   compressed data is spooled until the index can be written.
+
+   write_tar_entry() writes a tar member for entry i of ``ar'', decoding its
+   data from the current position of src. write_tar_entry_data() writes one
+   from the ``size'' bytes of decoded data at ``data'' instead. end_tar()
+   writes the end-of-archive marker. */
+void create_archive_from_tar( const char *archive_path, const char *tar_path,
+                              Compression com );
+void write_tar_entry(FILE *dst, const Archive *ar, size_t i, FILE *src);
+void write_tar_entry_data( FILE *dst, const Archive *ar, size_t i,
+                           const void *data, size_t size );
+void end_tar(FILE *dst);
+
+/* Importing pre-compressed files (import_archive.c)
+
+   is_container() returns whether a file name is that of a supported
+   container, based on its extension: .zip, .gz or .lzma. The caller must
+   check that the path is a regular file. import_container() adds the files in
+   a container to the index of the archive being written; deflated and
+   LZMA compressed data is later copied as-is by write_imported_entry(),
+   which returns zero if entry i was not imported. */
+int is_container(const char *path);
+void import_container(const char *path);
+int write_imported_entry(size_t i, Compression max_com);
+
+/* Archive recompression */
+void recompress_archive( const char *input_path, const char *output_path,
+                         Compression com );
+
+/* Converts the LZMA compressed entries of an archive to the header variant
+   with (if lzma_size is nonzero) or without the uncompressed size, without
+   recompressing them. The variant used by the input is detected. */
+void convert_archive( const char *input_path, const char *output_path,
+                      int lzma_size );
+
+/* Copies the entries of an archive whose paths match the given patterns
+   to a new archive, without recompressing them. See match_patterns(). */
+void repack_archive( const char *input_path, const char *output_path,
+                     const char * const *patterns_begin,
+                     const char * const *patterns_end );
+
+/* Merges archives into a new archive, without recompressing entries. When
+   several archives contain the same path (ignoring case), the entry from the
+   last archive is used, in the index position of the first. */
+void merge_archives( const char *output_path,
+                     const char * const *inputs_begin,
+                     const char * const *inputs_end );
+
+/* Like merge_archives(), but takes an overlay. Entries whose paths occur
+   in ``removed'' (if not NULL) are left out. */
+void write_merged_archive( const char *output_path, const Overlay *ov,
+                           const HashTable *removed );
+
+/* Archive comparison (compare_archives.c)
+
+   compare_entries() matches the entries of two archives by path (ignoring
+   case) and fills in new_status[j] for each entry j of new_ar, and
+   old_removed[i] for each entry i of old_ar. Matching entries are equal if
+   their names, compression methods, sizes and checksums of stored data are
+   equal; no data is decompressed. If both archives include checksums (see
+   read_checksums()), no data is read at all. If ``exact'' is nonzero, the
+   stored data is compared byte by byte instead, so that a checksum
+   collision cannot make a changed entry look unchanged. */
+enum EntryStatus { ENTRY_UNCHANGED, ENTRY_ADDED, ENTRY_CHANGED };
+void compare_entries( Archive *old_ar, Archive *new_ar,
+                      char *new_status, char *old_removed, int exact );
+
+/* Prints the differences between two archives. Returns the number of
+   entries that were added, removed or changed. */
+size_t compare_archives(const char *old_path, const char *new_path);
+
+/* Verifies an archive without writing anything (verify_archive.c): checks
+   that the data of every entry is 16-byte aligned, lies within the file
+   after the index and does not overlap other entries, and that it decodes
+   (in parallel) to the size recorded in the index. Prints the problems
+   found and returns their number. */
+size_t verify_archive(const char *path);
+
+/* Patch archives (patch_archive.c)
+
+   A patch archive contains the entries of a new archive that were added or
+   changed with respect to an old archive, plus an entry PATCH_REMOVED_PATH
+   listing the paths that were removed, one per line. Applying the patch to
+   the old archive yields an archive with the same contents as the new one.
+   Unchanged entries keep their place in the index, and added entries are
+   appended at the end. */
+#define PATCH_REMOVED_DIR  ".hhapatch"
+#define PATCH_REMOVED_FILE "removed"
+void diff_archives( const char *old_path, const char *new_path,
+                    const char *patch_path );
+void apply_patch( const char *old_path, const char *patch_path,
+                  const char *output_path );
+
+/* Writes the contents of an archive to a ZIP file (export_zip.c).
+   Deflated entries are copied as-is; LZMA compressed entries are decoded
+   and deflated again (or stored, if that is smaller), in parallel.
+   Uncompressed entries are stored. */
+void export_zip(const char *archive_path, const char *zip_path);
+
+/* Parallel processing (parallel.c)
+
+   Calls func(arg, i, worker) for each i in [0, count), using at most
+   num_workers() threads concurrently. ``worker'' identifies the calling
+   thread and is in range [0, num_workers()). */
+extern int num_threads;     /* Number of threads to use (0: automatic) */
+int num_workers();
+void run_parallel(size_t count, void (*func)(void *arg, size_t i, int worker),
+                  void *arg);
+
+/* Asynchronous reading (async_read.c)
+
+   A reader decodes entries of a seekable archive on a pool of up to
+   num_workers() background threads, each with its own handle to the
+   archive. Workers are started only as queued requests need them. Queued
+   requests are served in order of increasing offset, and requests for
+   entries whose data lies close together are served with a single read (or
+   straight from the mapping, if the archive is mapped).
+
+   read_entry_async() queues entry i to be decoded into ``buf'', which must
+   hold the entry's decoded size, and returns immediately. When the entry
+   is decoded, callback(arg, i, size) is called on a worker thread with the
+   number of bytes decoded; it is called right away with (size_t)-1 if the
+   entry's data lies outside the file. prefetch_entries() only advises the
+   system that the given entries will be read soon (with posix_madvise() if
+   the archive is mapped, or posix_fadvise() otherwise); it reads nothing
+   and starts no workers. wait_reader() waits until all queued requests are
+   completed, and close_reader() waits, then stops the workers. Callbacks
+   must not call wait_reader() or close_reader(). */
+typedef struct Reader Reader;
+Reader *open_reader(Archive *ar);
+void read_entry_async( Reader *rd, size_t i, void *buf,
+                       void (*callback)(void *arg, size_t i, size_t size),
+                       void *arg );
+void prefetch_entries(Reader *rd, const size_t *entries, size_t count);
+void wait_reader(Reader *rd);
+void close_reader(Reader *rd);
 
 
 #endif /* ndef COMMON_H_INCLUDED */
@@ -0,0 +1,215 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Candidate
+{
+    size_t      old_entry, new_entry;
+    int         changed;
+};
+
+struct Comparison
+{
+    Archive             *old_ar, *new_ar;
+    struct Candidate    *candidates;
+    int                 exact;      /* Compare stored data byte by byte */
+};
+
+/* Returns whether the stored data of entry i of ``a'' and entry j of ``b''
+   (which have equal stored sizes) is identical. */
+static int same_stored_data(Archive *a, size_t i, Archive *b, size_t j)
+{
+    unsigned char buf_a[4096], buf_b[4096];
+    const unsigned char *data_a, *data_b;
+    size_t left, chunk;
+
+    if ((data_a = entry_data(a, i)) != NULL &&
+        (data_b = entry_data(b, j)) != NULL)
+    {
+        return memcmp(data_a, data_b, a->entries[i].stored_size) == 0;
+    }
+
+    seek_entry(a, i);
+    seek_entry(b, j);
+    for (left = a->entries[i].stored_size; left > 0; left -= chunk)
+    {
+        chunk = left < sizeof(buf_a) ? left : sizeof(buf_a);
+        if (fread(buf_a, 1, chunk, a->fp) != chunk ||
+            fread(buf_b, 1, chunk, b->fp) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        if (memcmp(buf_a, buf_b, chunk) != 0) return 0;
+    }
+    return 1;
+}
+
+static void compare_checksums(void *arg, size_t k, int worker)
+{
+    struct Comparison *cmp = arg;
+    struct Candidate *c = &cmp->candidates[k];
+
+    (void)worker;
+    if (cmp->exact)
+    {
+        c->changed = !same_stored_data( cmp->old_ar, c->old_entry,
+                                        cmp->new_ar, c->new_entry );
+        return;
+    }
+    if (cmp->old_ar->checksums != NULL && cmp->new_ar->checksums != NULL)
+    {
+        /* Both archives carry checksums; no need to read any data */
+        c->changed =
+            cmp->old_ar->checksums[c->old_entry].stored !=
+                cmp->new_ar->checksums[c->new_entry].stored ||
+            cmp->old_ar->checksums[c->old_entry].decoded !=
+                cmp->new_ar->checksums[c->new_entry].decoded;
+        return;
+    }
+    c->changed = checksum_entry(cmp->old_ar, c->old_entry) !=
+                 checksum_entry(cmp->new_ar, c->new_entry);
+}
+
+void compare_entries( Archive *old_ar, Archive *new_ar,
+                      char *new_status, char *old_removed, int exact )
+{
+    struct Comparison cmp;
+    HashTable *old_paths;
+    size_t i, j, k, candidates_size;
+    const IndexEntry *e, *f;
+
+    /* Index old paths (if a path occurs more than once, the last entry
+       shadows the earlier ones, as in merge_archives()) */
+    load_paths(old_ar);
+    load_paths(new_ar);
+    old_paths = create_hash_table(1);
+    for (i = 0; i < old_ar->entries_size; ++i)
+    {
+        j = hash_insert_hashed( old_paths, entry_full_path(old_ar, i),
+                                old_ar->hashes[i], i );
+        if (j != (size_t)-1) old_removed[j] = 0;
+        old_removed[i] = 1;
+    }
+
+    /* Match new entries; compare everything but the stored data */
+    cmp.old_ar = old_ar;
+    cmp.new_ar = new_ar;
+    cmp.exact  = exact;
+    cmp.candidates = malloc(sizeof(struct Candidate)*new_ar->entries_size);
+    assert(cmp.candidates != NULL || new_ar->entries_size == 0);
+    candidates_size = 0;
+    for (j = 0; j < new_ar->entries_size; ++j)
+    {
+        i = hash_lookup_hashed( old_paths, entry_full_path(new_ar, j),
+                                new_ar->hashes[j] );
+        if (i == (size_t)-1)
+        {
+            new_status[j] = ENTRY_ADDED;
+            continue;
+        }
+        old_removed[i] = 0;
+
+        e = &old_ar->entries[i];
+        f = &new_ar->entries[j];
+        if (strcmp(strat(old_ar, e->dir_name), strat(new_ar, f->dir_name)) ||
+            strcmp(strat(old_ar, e->file_name), strat(new_ar, f->file_name)) ||
+            e->compression != f->compression || e->size != f->size ||
+            e->stored_size != f->stored_size)
+        {
+            new_status[j] = ENTRY_CHANGED;
+        }
+        else
+        {
+            new_status[j] = ENTRY_UNCHANGED;
+            cmp.candidates[candidates_size].old_entry = i;
+            cmp.candidates[candidates_size].new_entry = j;
+            ++candidates_size;
+        }
+    }
+    free_hash_table(old_paths);
+
+    /* Compare checksums of stored data of candidates: those stored in the
+       archives if both have them, or else computed in parallel, if both
+       archives can be memory-mapped. Exact comparisons read the data too,
+       in parallel if both archives are mapped. */
+    if (!exact && old_ar->checksums != NULL && new_ar->checksums != NULL)
+    {
+        for (k = 0; k < candidates_size; ++k) compare_checksums(&cmp, k, 0);
+    }
+    else
+    if (map_archive(old_ar) && map_archive(new_ar))
+    {
+        run_parallel(candidates_size, compare_checksums, &cmp);
+    }
+    else
+    {
+        for (k = 0; k < candidates_size; ++k) compare_checksums(&cmp, k, 0);
+    }
+    for (k = 0; k < candidates_size; ++k)
+    {
+        if (cmp.candidates[k].changed)
+        {
+            new_status[cmp.candidates[k].new_entry] = ENTRY_CHANGED;
+        }
+    }
+    free(cmp.candidates);
+}
+
+size_t compare_archives(const char *old_path, const char *new_path)
+{
+    Archive *old_ar, *new_ar;
+    char *new_status, *old_removed, path[PATH_LEN];
+    size_t i, j, added, removed, changed;
+
+    old_ar = open_archive(old_path);
+    new_ar = open_archive(new_path);
+    if (!old_ar->seekable || !new_ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n",
+                        old_ar->seekable ? new_path : old_path);
+        exit(1);
+    }
+
+    new_status  = malloc(new_ar->entries_size + 1);
+    old_removed = malloc(old_ar->entries_size + 1);
+    assert(new_status != NULL && old_removed != NULL);
+    compare_entries(old_ar, new_ar, new_status, old_removed, 0);
+
+    added = removed = changed = 0;
+    for (i = 0; i < old_ar->entries_size; ++i)
+    {
+        if (old_removed[i])
+        {
+            entry_path(old_ar, i, path);
+            printf("D %s\n", path);
+            ++removed;
+        }
+    }
+    for (j = 0; j < new_ar->entries_size; ++j)
+    {
+        if (new_status[j] == ENTRY_UNCHANGED) continue;
+        entry_path(new_ar, j, path);
+        if (new_status[j] == ENTRY_ADDED)
+        {
+            printf("A %s\n", path);
+            ++added;
+        }
+        else
+        {
+            printf("M %s\n", path);
+            ++changed;
+        }
+    }
+    printf("%ld added, %ld removed, %ld changed.\n",
+           (long)added, (long)removed, (long)changed);
+
+    free(new_status);
+    free(old_removed);
+    close_archive(old_ar);
+    close_archive(new_ar);
+
+    return added + removed + changed;
+}
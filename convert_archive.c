@@ -0,0 +1,178 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+#define LZMA_PROPS_SIZE 5
+
+/* Reads the first bytes of an LZMA compressed entry and returns 1 if they
+   contain the uncompressed size, 0 if they do not, or -1 if it cannot be
+   told (both interpretations are plausible). The compressed stream itself
+   always starts with a zero byte, while the size field must match the size
+   recorded in the index. */
+static int entry_has_size(Archive *ar, size_t i)
+{
+    const IndexEntry *e = &ar->entries[i];
+    unsigned char header[LZMA_PROPS_SIZE + 8];
+    int with_size, without_size;
+
+    if (e->stored_size < sizeof(header)) return 0;
+    seek_entry(ar, i);
+    if (fread(header, 1, sizeof(header), ar->fp) != sizeof(header))
+    {
+        perror("Read failed");
+        abort();
+    }
+    with_size    = get_uint32(header + LZMA_PROPS_SIZE) == e->size &&
+                   get_uint32(header + LZMA_PROPS_SIZE + 4) == 0;
+    without_size = header[LZMA_PROPS_SIZE] == 0;
+    if (with_size == without_size) return -1;
+    return with_size;
+}
+
+/* Decides between both interpretations of an ambiguous LZMA entry by
+   decoding its data each way. Returns 1 if it contains the uncompressed
+   size, 0 if it does not, or -1 if this still cannot be told. */
+static int trial_decode_entry(Archive *ar, size_t i)
+{
+    const IndexEntry *e = &ar->entries[i];
+    unsigned char *data;
+    int with_size, without_size;
+
+    data = malloc(e->stored_size);
+    if (data == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    seek_entry(ar, i);
+    if (fread(data, 1, e->stored_size, ar->fp) != e->stored_size)
+    {
+        perror("Read failed");
+        abort();
+    }
+    with_size    = check_lzma_buffer(data, e->stored_size, e->size, 1);
+    without_size = check_lzma_buffer(data, e->stored_size, e->size, 0);
+    free(data);
+    if (with_size == without_size) return -1;
+    return with_size > without_size;
+}
+
+/* Returns 1 if the LZMA entries of the archive contain the uncompressed
+   size, 0 if they do not, or -1 if there are none. Exits if this cannot be
+   determined. Entries whose headers fit both variants are decoded only if
+   no other entry tells. */
+static int detect_lzma_size(Archive *ar)
+{
+    size_t i, lzma_entries = 0, count[2] = { 0, 0 };
+    int res;
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (ar->entries[i].compression != COM_LZMA) continue;
+        ++lzma_entries;
+        res = entry_has_size(ar, i);
+        if (res >= 0) ++count[res];
+    }
+    for (i = 0; i < ar->entries_size && count[0] + count[1] == 0; ++i)
+    {
+        if (ar->entries[i].compression != COM_LZMA ||
+            entry_has_size(ar, i) >= 0) continue;
+        res = trial_decode_entry(ar, i);
+        if (res >= 0) ++count[res];
+    }
+    if (count[0] > 0 && count[1] > 0)
+    {
+        fprintf(stderr, "%s: LZMA entries with and without uncompressed size "
+                        "found.\n", ar->path);
+        exit(1);
+    }
+    if (lzma_entries == 0) return -1;
+    if (count[0] + count[1] == 0)
+    {
+        fprintf(stderr, "%s: cannot tell whether LZMA entries include the "
+                        "uncompressed size.\n", ar->path);
+        exit(1);
+    }
+    return count[1] > 0;
+}
+
+void convert_archive( const char *input_path, const char *output_path,
+                      int lzma_size )
+{
+    Archive *ar;
+    const IndexEntry *e;
+    unsigned char header[LZMA_PROPS_SIZE + 8];
+    char path[PATH_LEN];
+    size_t i, header_size;
+    int has_size;
+
+    ar = open_archive(input_path);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", input_path);
+        exit(1);
+    }
+
+    has_size = detect_lzma_size(ar);
+    if (has_size < 0)
+    {
+        fprintf(stderr, "%s: no LZMA entries to convert.\n", input_path);
+        has_size = lzma_size;
+    }
+    else
+    if (has_size == lzma_size)
+    {
+        fprintf(stderr, "%s: LZMA entries already %s uncompressed size.\n",
+                        input_path, lzma_size ? "include" : "omit");
+    }
+
+    /* Keep string table and index order of the input archive; the stored
+       sizes of converted entries are updated when they are written. */
+    begin_archive(output_path);
+    add_strings(ar->strings, ar->strings_size);
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        e = &ar->entries[i];
+        add_entry( e->dir_name, e->file_name, e->compression, e->size,
+                   e->stored_size );
+    }
+    write_index();
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        e = &ar->entries[i];
+        header_size = LZMA_PROPS_SIZE + (has_size ? 8 : 0);
+        seek_entry(ar, i);
+        if (e->compression != COM_LZMA || has_size == lzma_size ||
+            e->stored_size < header_size)
+        {
+            write_entry_raw(i, ar->fp, e->compression, e->stored_size);
+            continue;
+        }
+
+        entry_path(ar, i, path);
+        fprintf(fp_msg, "Converting %s...\n", path);
+
+        /* Rewrite header and copy compressed stream as-is */
+        if (fread(header, 1, header_size, ar->fp) != header_size)
+        {
+            perror("Read failed");
+            abort();
+        }
+        memset(header + LZMA_PROPS_SIZE, 0, 8);
+        put_uint32(header + LZMA_PROPS_SIZE, e->size);
+        begin_entry(i, COM_LZMA);
+        write_entry_bytes(header, LZMA_PROPS_SIZE + (lzma_size ? 8 : 0));
+        copy_entry_bytes(ar->fp, e->stored_size - header_size);
+        end_entry(i);
+    }
+
+    /* Checksums (if added) must be computed for the converted entries */
+    lzma_omit_uncompressed_size = !lzma_size;
+    end_archive();
+    close_archive(ar);
+}
@@ -0,0 +1,230 @@
+#include "common.h"
+#include <string.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+/* CRC-32C (Castagnoli) polynomial, bit-reversed */
+#define POLY 0x82f63b78ul
+
+/* The hardware implementation computes the CRC of three blocks of this
+   size at a time, which hides the latency of the crc32 instruction. */
+#define LONG_BLOCK  8192
+#define SHORT_BLOCK 256
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_SSE42_CRC32
+#endif
+
+/* Tables for byte-wise calculation (slicing by 8) */
+static uint32_t crc_table[8][256];
+
+#ifdef HAVE_SSE42_CRC32
+/* Tables for shifting a CRC by LONG_BLOCK and SHORT_BLOCK zero bytes */
+static uint32_t crc_long[4][256], crc_short[4][256];
+static int have_sse42;
+#endif
+
+#ifdef HAVE_SSE42_CRC32
+
+/* Multiplies the 32x32 GF(2) matrix ``mat'' with the vector ``vec'' */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for ( ; vec != 0; vec >>= 1, ++mat)
+    {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; ++n) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Stores in ``even'' the operator that appends ``len'' zero bytes to a CRC;
+   ``len'' must be a power of two. */
+static void crc_zeros_op(uint32_t even[32], size_t len)
+{
+    uint32_t odd[32], row;
+    int n;
+
+    /* Operator for one zero bit in odd, then two and four in even/odd */
+    odd[0] = POLY;
+    for (n = 1, row = 1; n < 32; ++n, row <<= 1) odd[n] = row;
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    /* Square until the operator covers ``len'' bytes */
+    for (;;)
+    {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0) return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+        if (len == 0) break;
+    }
+    memcpy(even, odd, sizeof(odd));
+}
+
+/* Fills tables to shift a CRC by ``len'' zero bytes with crc_shift() */
+static void crc_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[32];
+    uint32_t n;
+
+    crc_zeros_op(op, len);
+    for (n = 0; n < 256; ++n)
+    {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t crc_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint64_t load_uint64(const unsigned char *p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Computes the CRC of three adjacent blocks at a time in independent
+   registers, then combines them by shifting. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    unsigned long long crc0, crc1, crc2;
+    const unsigned char *end;
+
+    crc0 = crc ^ 0xfffffffful;
+    while (len > 0 && (size_t)p%8 != 0)
+    {
+        crc0 = __builtin_ia32_crc32qi((unsigned)crc0, *p++);
+        --len;
+    }
+    while (len >= 3*LONG_BLOCK)
+    {
+        crc1 = crc2 = 0;
+        for (end = p + LONG_BLOCK; p < end; p += 8)
+        {
+            crc0 = __builtin_ia32_crc32di(crc0, load_uint64(p));
+            crc1 = __builtin_ia32_crc32di(crc1, load_uint64(p + LONG_BLOCK));
+            crc2 = __builtin_ia32_crc32di(crc2, load_uint64(p + 2*LONG_BLOCK));
+        }
+        crc0 = crc_shift(crc_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc_shift(crc_long, (uint32_t)crc0) ^ crc2;
+        p   += 2*LONG_BLOCK;
+        len -= 3*LONG_BLOCK;
+    }
+    while (len >= 3*SHORT_BLOCK)
+    {
+        crc1 = crc2 = 0;
+        for (end = p + SHORT_BLOCK; p < end; p += 8)
+        {
+            crc0 = __builtin_ia32_crc32di(crc0, load_uint64(p));
+            crc1 = __builtin_ia32_crc32di(crc1, load_uint64(p + SHORT_BLOCK));
+            crc2 = __builtin_ia32_crc32di(crc2, load_uint64(p + 2*SHORT_BLOCK));
+        }
+        crc0 = crc_shift(crc_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc_shift(crc_short, (uint32_t)crc0) ^ crc2;
+        p   += 2*SHORT_BLOCK;
+        len -= 3*SHORT_BLOCK;
+    }
+    for ( ; len >= 8; p += 8, len -= 8)
+    {
+        crc0 = __builtin_ia32_crc32di(crc0, load_uint64(p));
+    }
+    while (len-- > 0)
+    {
+        crc0 = __builtin_ia32_crc32qi((unsigned)crc0, *p++);
+    }
+    return (uint32_t)crc0 ^ 0xfffffffful;
+}
+
+#endif /* def HAVE_SSE42_CRC32 */
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *p,
+                                size_t len)
+{
+    crc = ~crc;
+    while (len > 0 && (size_t)p%8 != 0)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+    for ( ; len >= 8; p += 8, len -= 8)
+    {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+               (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = crc_table[7][crc & 0xff] ^ crc_table[6][(crc >> 8) & 0xff] ^
+              crc_table[5][(crc >> 16) & 0xff] ^ crc_table[4][crc >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+              crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    while (len-- > 0)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void init_tables()
+{
+    uint32_t n, k, crc;
+
+    for (n = 0; n < 256; ++n)
+    {
+        crc = n;
+        for (k = 0; k < 8; ++k) crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; ++n)
+    {
+        for (k = 1; k < 8; ++k)
+        {
+            crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^
+                              crc_table[0][crc_table[k - 1][n] & 0xff];
+        }
+    }
+#ifdef HAVE_SSE42_CRC32
+    crc_zeros(crc_long,  LONG_BLOCK);
+    crc_zeros(crc_short, SHORT_BLOCK);
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+#ifndef WIN32
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, init_tables);
+#else
+    static int initialized = 0;
+
+    if (!initialized)
+    {
+        init_tables();
+        initialized = 1;
+    }
+#endif
+#ifdef HAVE_SSE42_CRC32
+    if (have_sse42) return crc32c_sse42(crc, data, size);
+#endif
+    return crc32c_portable(crc, data, size);
+}
@@ -8,48 +8,65 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#define PATH_LEN 1024
-
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 
 int ftruncate(int fd, off_t length);
 
 
 /* Global variables -- used while creating an archive */
 
-struct Header header;
-FILE *fp;
-size_t pos;
+static struct Header header;
+static FILE *fp;                /* archive being written (or data spool) */
+static FILE *fp_out;            /* final output (if different from fp) */
+static int spooled;             /* writing entry data to a spool file */
+static size_t pos;
+FILE *fp_msg;                   /* progress messages */
+int add_checksums = 0;          /* append checksums in end_archive() */
 
 /* Index table */
-struct IndexEntry *entries;
-size_t entries_size, entries_capacity;
+static struct IndexEntry *entries;
+static size_t entries_size, entries_capacity;
+static size_t *index_order;     /* order in which entries are written */
+int sort_index = 0;             /* sort index by path in write_index() */
+size_t store_alignment = 16;    /* alignment of uncompressed entries */
 
 /* String table */
-char *strings;
-size_t strings_size, strings_capacity;
+static char *strings;
+static size_t strings_size, strings_capacity;
+static HashTable *interned_strings;
 
 static void free_entries()
 {
     free(entries);
+    free(index_order);
     entries = NULL;
+    index_order = NULL;
     entries_size = entries_capacity = 0;
 }
 
 static void free_strings()
 {
+    if (interned_strings != NULL)
+    {
+        free_hash_table(interned_strings);
+        interned_strings = NULL;
+    }
     free(strings);
     strings = NULL;
     strings_size = strings_capacity = 0;
 }
 
-static uint32_t alloc_string(const char *str)
+/* Appends ``size'' bytes of raw string table data (which should consist of
+   zero-terminated strings) to the string table. */
+void add_strings(const char *data, size_t size)
 {
-    size_t pos, len;
-
-    len = strlen(str);
-
     /* Allocate space (if required) */
-    while (strings_capacity - strings_size < len + 1)
+    while (strings_capacity - strings_size < size)
     {
         strings_capacity = strings_capacity > 0 ? 2*strings_capacity : 64;
         assert((uint32_t)strings_capacity == strings_capacity);
@@ -58,15 +75,37 @@ static uint32_t alloc_string(const char *str)
         memset(strings + strings_size, 0, strings_capacity - strings_size);
     }
 
-    /* Copy string */
+    /* Copy data */
+    memcpy(strings + strings_size, data, size);
+    strings_size += size;
+}
+
+uint32_t add_string(const char *str)
+{
+    size_t pos;
+
     pos = strings_size;
-    strings_size += len + 1;
-    memcpy(strings + pos, str, len);
+    add_strings(str, strlen(str) + 1);
+
+    return (uint32_t)pos;
+}
+
+uint32_t intern_string(const char *str)
+{
+    size_t pos;
 
+    if (interned_strings == NULL) interned_strings = create_hash_table(0);
+    pos = hash_lookup(interned_strings, str);
+    if (pos == (size_t)-1)
+    {
+        pos = add_string(str);
+        hash_insert(interned_strings, str, pos);
+    }
     return (uint32_t)pos;
 }
 
-static void alloc_entry(const char *dir, const char *file, size_t file_size)
+size_t add_entry( uint32_t dir_name, uint32_t file_name,
+                  Compression com, size_t size, size_t stored_size )
 {
     IndexEntry *e;
 
@@ -78,21 +117,33 @@ static void alloc_entry(const char *dir, const char *file, size_t file_size)
         assert(entries != NULL);
     }
 
-    e = &entries[entries_size++];
-    if (entries_size > 1 && strcmp(strings + e[-1].dir_name, dir) == 0)
+    e = &entries[entries_size];
+    e->dir_name     = dir_name;
+    e->file_name    = file_name;
+    e->compression  = com;
+    e->offset       = 0;
+    e->size         = size;
+    e->stored_size  = stored_size;
+
+    return entries_size++;
+}
+
+size_t alloc_entry( const char *dir, const char *file,
+                    Compression com, size_t size, size_t stored_size )
+{
+    uint32_t dir_name;
+
+    if (entries_size > 0 &&
+        strcmp(strings + entries[entries_size - 1].dir_name, dir) == 0)
     {
         /* Directory is the same as last entry; use the same address. */
-        e->dir_name     = e[-1].dir_name;
+        dir_name = entries[entries_size - 1].dir_name;
     }
     else
     {
-        e->dir_name     = alloc_string(dir);
+        dir_name = add_string(dir);
     }
-    e->file_name    = alloc_string(file);
-    e->compression  = 0;
-    e->offset       = 0;
-    e->size         = file_size;
-    e->stored_size  = 0;
+    return add_entry(dir_name, add_string(file), com, size, stored_size);
 }
 
 static void walk(char path[PATH_LEN], size_t path_len)
@@ -138,11 +189,12 @@ static void walk(char path[PATH_LEN], size_t path_len)
         {
             if ((uint32_t)st.st_size != st.st_size)
             {
-                printf("%s: file too big; skipped.\n", path);
+                fprintf(fp_msg, "%s: file too big; skipped.\n", path);
                 continue;
             }
             path[path_len] = '\0';
-            alloc_entry(path, path + path_len + 1, (size_t)st.st_size);
+            alloc_entry( path, path + path_len + 1,
+                         COM_NONE, (size_t)st.st_size, 0 );
             path[path_len] = '/';
         }
         else
@@ -159,14 +211,17 @@ static void walk(char path[PATH_LEN], size_t path_len)
     closedir(dir);
 }
 
-static void write_padding()
+/* Writes zeroes up to the next multiple of ``alignment'' (a power of two
+   of at least 16) */
+static void write_padding(size_t alignment)
 {
-    static const char padding[16] = { 0 };
+    static const char padding[256] = { 0 };
     size_t len;
 
-    if (pos%16 != 0)
+    while (pos%alignment != 0)
     {
-        len = 16 - pos%16;
+        len = alignment - pos%alignment;
+        if (len > sizeof(padding)) len = sizeof(padding);
         if (fwrite(padding, len, 1, fp) != 1)
         {
             perror("Could not write padding\n");
@@ -176,9 +231,81 @@ static void write_padding()
     }
 }
 
-static void write_headers()
+/* Stores the full path of entry i in ``path'' */
+static void get_entry_path(size_t i, char path[PATH_LEN])
+{
+    const char *dir = strings + entries[i].dir_name,
+               *file = strings + entries[i].file_name;
+
+    assert(strlen(dir) + 1 + strlen(file) < PATH_LEN);
+    strcpy(path, dir);
+    if (*dir != '\0') strcat(path, "/");
+    strcat(path, file);
+}
+
+static int cmp_entry_path(const void *a, const void *b)
+{
+    size_t i = *(const size_t*)a, j = *(const size_t*)b;
+    char path_i[PATH_LEN], path_j[PATH_LEN];
+    int res;
+
+    get_entry_path(i, path_i);
+    get_entry_path(j, path_j);
+    res = compare_strings(path_i, path_j, 1);
+    if (res != 0) return res;
+    return i < j ? -1 : i > j ? 1 : 0;
+}
+
+/* Determines the order of entries in the index. Data is always written in
+   the order the entries were added; the index may be sorted by path
+   (ignoring case), keeping entries with the same path in order. */
+static void order_index()
+{
+    size_t i;
+
+    free(index_order);
+    index_order = malloc(sizeof(size_t)*entries_size + 1);
+    assert(index_order != NULL);
+    for (i = 0; i < entries_size; ++i) index_order[i] = i;
+    if (sort_index)
+    {
+        qsort(index_order, entries_size, sizeof(size_t), cmp_entry_path);
+    }
+}
+
+static void write_index_entries(const char *error)
+{
+    size_t k;
+
+    for (k = 0; k < entries_size; ++k)
+    {
+        if (fwrite(&entries[index_order[k]], sizeof(IndexEntry), 1, fp) != 1)
+        {
+            perror(error);
+            abort();
+        }
+    }
+}
+
+/* Fills in the archive header and pads the string table */
+static void prepare_header()
+{
+    /* Create header */
+    header.unknown1         = (uint32_t)0xac2ff34ful;
+    header.unknown2         = 0;
+    header.unknown3         = 1;
+    header.strings_size     = (uint32_t)strings_size;
+    header.index_entries    = (uint32_t)entries_size;
+
+    /* Pad string table size to 16 byte boundary */
+    while (header.strings_size%16 != 0) ++header.strings_size;
+    add_strings("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",
+                header.strings_size - strings_size);
+}
+
+/* Writes the header, string table and index at the start of the output */
+static void write_header_and_index()
 {
-    /* Write header, strings table, and preliminary index table */
     pos = 0;
     if (fwrite(&header, sizeof(header), 1, fp) != 1)
     {
@@ -194,35 +321,44 @@ static void write_headers()
     }
     pos += header.strings_size;
 
-    if (fwrite(entries, sizeof(IndexEntry), entries_size, fp) != entries_size)
-    {
-        perror("Could not write index");
-        abort();
-    }
+    order_index();
+    write_index_entries("Could not write index");
     pos += header.index_entries*sizeof(IndexEntry);
 
-    write_padding();
+    write_padding(16);
 }
 
-static size_t write_file(const char *path, size_t size_in, Compression *max_com)
+void write_index()
+{
+    /* A spooled archive's index is written by end_archive() */
+    if (spooled) return;
+
+    /* Write header, strings table, and preliminary index table */
+    prepare_header();
+    write_header_and_index();
+}
+
+size_t compress_data(FILE *dst, FILE *src, size_t size_in, Compression *max_com)
 {
-    FILE *fp_in;
     Compression best_com;
     size_t size, best_size;
+    long pos_out, pos_in;
 
-    fp_in = fopen(path, "rb");
-    assert(fp_in != NULL);
+    pos_out = ftell(dst);
+    pos_in  = ftell(src);
+    assert(pos_out != -1 && pos_in != -1);
 
     /* Initially, assume no compression is best. */
     best_com  = COM_NONE;
     best_size = size_in;
+    if (size_in == 0) *max_com = COM_NONE;   /* nothing to compress */
 
     if (*max_com >= COM_DEFLATE)
     {
         /* Try deflate compression */
-        fseek(fp, pos, SEEK_SET);
-        rewind(fp_in);
-        size = copy_deflatec(fp, fp_in, size_in);
+        fseek(dst, pos_out, SEEK_SET);
+        fseek(src, pos_in, SEEK_SET);
+        size = copy_deflatec(dst, src, size_in);
         if (size < best_size)
         {
             best_size = size;
@@ -233,9 +369,9 @@ static size_t write_file(const char *path, size_t size_in, Compression *max_com)
     if (*max_com >= COM_LZMA)
     {
         /* Try LZMA compression */
-        fseek(fp, pos, SEEK_SET);
-        rewind(fp_in);
-        size = copy_lzmac(fp, fp_in, size_in);
+        fseek(dst, pos_out, SEEK_SET);
+        fseek(src, pos_in, SEEK_SET);
+        size = copy_lzmac(dst, src, size_in);
         if (size < best_size)
         {
             best_size = size;
@@ -245,94 +381,374 @@ static size_t write_file(const char *path, size_t size_in, Compression *max_com)
 
     if (best_com == COM_NONE)
     {
-        fseek(fp, pos, SEEK_SET);
-        rewind(fp_in);
-        size = copy_uncompressed(fp, fp_in, size_in);
+        fseek(dst, pos_out, SEEK_SET);
+        fseek(src, pos_in, SEEK_SET);
+        size = copy_uncompressed(dst, src, size_in);
     }
 
     if (best_com == COM_DEFLATE && *max_com > COM_DEFLATE)
     {
-        fseek(fp, pos, SEEK_SET);
-        rewind(fp_in);
-        size = copy_deflatec(fp, fp_in, size_in);
+        fseek(dst, pos_out, SEEK_SET);
+        fseek(src, pos_in, SEEK_SET);
+        size = copy_deflatec(dst, src, size_in);
     }
 
-    fclose(fp_in);
-
     *max_com = best_com;
     assert(size == best_size);
     return best_size;
 }
 
+size_t write_entry(size_t i, FILE *src, Compression max_com)
+{
+    long pos_in;
+
+    pos_in = ftell(src);
+    fseek(fp, pos, SEEK_SET);
+    if (max_com == COM_NONE) write_padding(store_alignment);
+    entries[i].offset      = pos;
+    entries[i].stored_size = compress_data(fp, src, entries[i].size, &max_com);
+    entries[i].compression = max_com;
+
+    if (max_com == COM_NONE && pos%store_alignment != 0)
+    {
+        /* Compression did not pay off; store the data at an aligned
+           offset instead */
+        fseek(fp, pos, SEEK_SET);
+        fseek(src, pos_in, SEEK_SET);
+        write_padding(store_alignment);
+        entries[i].offset      = pos;
+        entries[i].stored_size = copy_uncompressed(fp, src, entries[i].size);
+    }
+
+    pos += entries[i].stored_size;
+    write_padding(16);
+
+    return entries[i].stored_size;
+}
+
+void write_entry_raw(size_t i, FILE *src, Compression com, size_t stored_size)
+{
+    begin_entry(i, com);
+    copy_entry_bytes(src, stored_size);
+    end_entry(i);
+}
+
+void begin_entry(size_t i, Compression com)
+{
+    fseek(fp, pos, SEEK_SET);
+    if (com == COM_NONE) write_padding(store_alignment);
+    entries[i].compression = com;
+    entries[i].offset      = pos;
+}
+
+void write_entry_bytes(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, fp) != size)
+    {
+        perror("Write failed");
+        abort();
+    }
+    pos += size;
+}
+
+void copy_entry_bytes(FILE *src, size_t size)
+{
+    pos += copy_raw(fp, src, size);
+}
+
+void end_entry(size_t i)
+{
+    entries[i].stored_size = pos - entries[i].offset;
+    write_padding(16);
+}
+
 static void write_files(Compression max_com)
 {
     size_t i;
     char path[PATH_LEN];
-    Compression com;
-    size_t stored_size;
+    FILE *fp_in;
 
     for (i = 0; i < entries_size; ++i)
     {
-        strcpy(path, strings + entries[i].dir_name);
-        strcat(path, "/");
-        strcat(path, strings + entries[i].file_name);
-
-        printf("Adding %s...\n", path);
+        get_entry_path(i, path);
 
-        com = max_com;
-        stored_size = write_file(path, entries[i].size, &com);
+        fprintf(fp_msg, "Adding %s...\n", path);
 
-        entries[i].compression = com;
-        entries[i].offset      = pos;
-        entries[i].stored_size = stored_size;
+        if (write_imported_entry(i, max_com)) continue;
 
-        pos += entries[i].stored_size;
-        write_padding();
+        fp_in = fopen(path, "rb");
+        assert(fp_in != NULL);
+        write_entry(i, fp_in, max_com);
+        fclose(fp_in);
     }
-
-    /* Truncate to remove extra data */
-    ftruncate(fileno(fp), pos);
 }
 
 static void rewrite_index()
 {
+    /* Truncate to remove extra data */
+    fflush(fp);
+    ftruncate(fileno(fp), pos);
+
     if (fseek(fp, sizeof(Header) + header.strings_size, SEEK_SET) != 0)
     {
         perror("Could not seek to archive index");
         abort();
     }
-    if (fwrite(entries, sizeof(IndexEntry), entries_size, fp) != entries_size)
+    write_index_entries("Could not rewrite index");
+}
+
+struct ChecksumJob
+{
+    const unsigned char *data;  /* Mapped archive */
+    EntryChecksums      *sums;  /* Checksums of each entry */
+};
+
+static void checksum_job_entry(void *arg, size_t i, int worker)
+{
+    struct ChecksumJob *job = arg;
+
+    (void)worker;
+    compute_checksums(&job->sums[i], job->data + entries[i].offset,
+                      &entries[i]);
+}
+
+/* Computes the checksums of all entries written to ``fp'' and returns them
+   in index order. Entries are checksummed in parallel through a mapping of
+   the file if possible, or else read back one at a time. */
+static EntryChecksums *compute_all_checksums()
+{
+    struct ChecksumJob job;
+    EntryChecksums *sums;
+    unsigned char *buf;
+    size_t i;
+
+    fprintf(fp_msg, "Computing checksums...\n");
+    fflush(fp);
+    job.sums = malloc(sizeof(EntryChecksums)*entries_size + 1);
+    assert(job.sums != NULL);
+
+    job.data = NULL;
+#ifndef WIN32
+    if (pos > 0 && (size_t)(off_t)pos == pos)
+    {
+        job.data = mmap(NULL, pos, PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (job.data == MAP_FAILED) job.data = NULL;
+    }
+#endif
+    if (job.data != NULL)
+    {
+        run_parallel(entries_size, checksum_job_entry, &job);
+#ifndef WIN32
+        munmap((void*)job.data, pos);
+#endif
+    }
+    else
+    {
+        for (i = 0; i < entries_size; ++i)
+        {
+            buf = malloc(entries[i].stored_size + 1);
+            assert(buf != NULL);
+            if (fseek(fp, entries[i].offset, SEEK_SET) != 0 ||
+                fread(buf, 1, entries[i].stored_size, fp) !=
+                    entries[i].stored_size)
+            {
+                perror("Could not read back entry");
+                abort();
+            }
+            compute_checksums(&job.sums[i], buf, &entries[i]);
+            free(buf);
+        }
+    }
+
+    /* Put checksums in index order */
+    sums = malloc(sizeof(EntryChecksums)*entries_size + 1);
+    assert(sums != NULL);
+    for (i = 0; i < entries_size; ++i) sums[i] = job.sums[index_order[i]];
+    free(job.sums);
+    return sums;
+}
+
+/* Computes the checksums of all entries and appends them to the archive */
+static void append_checksums()
+{
+    EntryChecksums *sums;
+
+    sums = compute_all_checksums();
+    if (fseek(fp, pos, SEEK_SET) != 0)
+    {
+        perror("Seek failed");
+        abort();
+    }
+    pos += write_checksums(fp, sums, entries_size);
+    free(sums);
+}
+
+/* Opens the output archive. Writing an archive requires seeking back and
+   forth, so if the output is not a regular file (e.g. a pipe, or standard
+   output when the path is "-"), or ``spool'' is nonzero, the entry data is
+   written to an anonymous spool file instead, at offsets relative to the
+   start of the data. The archive is then written to the real output
+   strictly forward when it is complete (see write_spooled_archive()). */
+static void open_output(const char *archive_path, int spool)
+{
+    struct stat st;
+
+    pos    = 0;
+    fp_msg = stdout;
+    if (strcmp(archive_path, "-") == 0)
+    {
+        fp_out = stdout;
+        fp_msg = stderr;
+#ifdef WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    else
+    {
+        fp_out = fopen(archive_path, "w+b");
+        if (fp_out == NULL)
+        {
+            perror(archive_path);
+            abort();
+        }
+    }
+
+    /* Standard output may be a regular file opened write-only, which
+       cannot be read back to compute checksums */
+    if (!spool && fstat(fileno(fp_out), &st) == 0 && S_ISREG(st.st_mode) &&
+        !(add_checksums && fp_out == stdout))
+    {
+        /* Write archive in-place */
+        fp = fp_out;
+        fp_out = NULL;
+        spooled = 0;
+    }
+    else
+    {
+        /* Use a temporary spool file for entry data */
+        fp = tmpfile();
+        if (fp == NULL)
+        {
+            perror("Could not create spool file");
+            abort();
+        }
+        spooled = 1;
+    }
+}
+
+/* Writes a spooled archive to the real output: the header, string table
+   and index, now that the offsets and sizes of all entries are known, then
+   the entry data copied from the spool file, and the checksums (if added).
+   The data starts at a multiple of store_alignment, so entries keep their
+   alignment when their offsets are moved past the index. */
+static void write_spooled_archive()
+{
+    EntryChecksums *sums = NULL;
+    FILE *fp_spool;
+    size_t i, data_size, data_start, alignment;
+
+    prepare_header();
+    order_index();
+    if (add_checksums) sums = compute_all_checksums();
+
+    alignment  = store_alignment > 16 ? store_alignment : 16;
+    data_start = sizeof(Header) + header.strings_size +
+                 sizeof(IndexEntry)*entries_size;
+    data_start = (data_start + alignment - 1)/alignment*alignment;
+    for (i = 0; i < entries_size; ++i)
+    {
+        assert((uint32_t)(entries[i].offset + data_start) ==
+               entries[i].offset + data_start);
+        entries[i].offset += (uint32_t)data_start;
+    }
+
+    /* Continue on the real output */
+    data_size = pos;
+    fp_spool  = fp;
+    fp        = fp_out;
+    fp_out    = NULL;
+    write_header_and_index();
+    write_padding(alignment);
+    assert(pos == data_start);
+
+    rewind(fp_spool);
+    pos += copy_uncompressed(fp, fp_spool, data_size);
+    fclose(fp_spool);
+    if (sums != NULL)
+    {
+        pos += write_checksums(fp, sums, entries_size);
+        free(sums);
+    }
+}
+
+/* Flushes and closes the output */
+static void close_output()
+{
+    if (fflush(fp) != 0)
     {
-        perror("Could not rewrite index");
+        perror("Write failed");
         abort();
     }
+    if (fp != stdout) fclose(fp);
+    fp = NULL;
+}
+
+void begin_archive(const char *archive_path)
+{
+    assert(sizeof(Header)     == 16);
+    assert(sizeof(IndexEntry) == 24);
+
+    open_output(archive_path, 0);
+}
+
+void begin_spooled_archive(const char *archive_path)
+{
+    assert(sizeof(Header)     == 16);
+    assert(sizeof(IndexEntry) == 24);
+
+    open_output(archive_path, 1);
+}
+
+void end_archive()
+{
+    if (spooled)
+    {
+        write_spooled_archive();
+    }
+    else
+    {
+        rewrite_index();
+        if (add_checksums) append_checksums();
+    }
+    free_entries();
+    free_strings();
+    close_output();
 }
 
 /* NOTE: this function is NOT re-entrant! */
 void create_archive( const char *archive_path,
                      const char * const *dirs_begin,
                      const char * const *dirs_end,
-                     Compression com )
+                     const char *containers, Compression com )
 {
     const char * const *p;
     size_t len;
     char path[PATH_LEN];
 
-    assert(sizeof(Header)     == 16);
-    assert(sizeof(IndexEntry) == 24);
-
     /* Open output archive */
-    fp = fopen(archive_path, "w+b");
-    if (fp == NULL)
-    {
-        perror(archive_path);
-        abort();
-    }
+    begin_archive(archive_path);
 
     /* Find all files to process by walking the directory trees */
     for (p = dirs_begin; p != dirs_end; ++p)
     {
-        printf("Searching for files in directory %s...\n", *p);
+        if (containers[p - dirs_begin])
+        {
+            fprintf(fp_msg, "Importing files from %s...\n", *p);
+            import_container(*p);
+            continue;
+        }
+
+        fprintf(fp_msg, "Searching for files in directory %s...\n", *p);
 
         len = strlen(*p);
         while (len > 0 && (*p)[len - 1] == '/') --len;
@@ -346,22 +762,8 @@ void create_archive( const char *archive_path,
         walk(path, len);
     }
 
-    /* Create header */
-    header.unknown1         = (uint32_t)0xac2ff34ful;
-    header.unknown2         = 0;
-    header.unknown3         = 1;
-    header.strings_size     = (uint32_t)strings_size;
-    header.index_entries    = (uint32_t)entries_size;
-
-    /* Pad string table size to 16 byte boundary */
-    while (header.strings_size%16 != 0) ++header.strings_size;
-
     /* Write headers */
-    write_headers();
+    write_index();
     write_files(com);
-    rewrite_index();
-
-    free_entries();
-    free_strings();
-    fclose(fp);
+    end_archive();
 }
@@ -4,7 +4,9 @@
 #include <string.h>
 #include <zlib.h>
 
-size_t copy_deflated(FILE *dst, FILE *src, size_t size_in)
+/* Decodes deflated data to dst (if not NULL), updating the CRC-32 of the
+   decoded data in *crc (if not NULL). */
+static size_t inflate_data(FILE *dst, FILE *src, size_t size_in, uLong *crc)
 {
     z_stream zs;
     unsigned char buf_in[4096], buf_out[4096];
@@ -38,7 +40,8 @@ size_t copy_deflated(FILE *dst, FILE *src, size_t size_in)
                 goto end;
             }
             chunk = sizeof(buf_out) - zs.avail_out;
-            if (fwrite(buf_out, 1, chunk, dst) != chunk)
+            if (crc != NULL) *crc = crc32(*crc, buf_out, (uInt)chunk);
+            if (dst != NULL && fwrite(buf_out, 1, chunk, dst) != chunk)
             {
                 perror("Write failed");
                 abort();
@@ -51,6 +54,264 @@ size_t copy_deflated(FILE *dst, FILE *src, size_t size_in)
         fprintf(stderr, "WARNING: inflate ended prematurely\n");
     }
 end:
+    inflateEnd(&zs);
+    skip_data(src, size_in);
+    return size_out;
+}
+
+size_t copy_deflated(FILE *dst, FILE *src, size_t size_in)
+{
+    return inflate_data(dst, src, size_in, NULL);
+}
+
+size_t crc_deflated(FILE *src, size_t size_in, uint32_t *crc)
+{
+    uLong value = crc32(0, Z_NULL, 0);
+    size_t size_out;
+
+    size_out = inflate_data(NULL, src, size_in, &value);
+    *crc = (uint32_t)value;
+    return size_out;
+}
+
+size_t measure_deflated(FILE *src, size_t size_in, size_t *size_out)
+{
+    z_stream zs;
+    unsigned char buf_in[4096], buf_out[4096];
+    size_t chunk, size_read;
+    int res;
+
+    *size_out = size_read = 0;
+    memset(&zs, 0, sizeof(zs));
+    res = inflateInit2(&zs, -15);
+    assert(res == Z_OK);
+    while (res != Z_STREAM_END && size_in > 0)
+    {
+        chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+        if (fread(buf_in, 1, chunk, src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        size_in   -= chunk;
+        size_read += chunk;
+
+        zs.next_in  = buf_in;
+        zs.avail_in = chunk;
+        do {
+            zs.next_out  = buf_out;
+            zs.avail_out = sizeof(buf_out);
+            res = inflate(&zs, Z_NO_FLUSH);
+            if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "WARNING: inflate failed!\n");
+                goto end;
+            }
+            *size_out += sizeof(buf_out) - zs.avail_out;
+        } while (zs.avail_out == 0 && res != Z_STREAM_END);
+    }
+    if (res != Z_STREAM_END)
+    {
+        fprintf(stderr, "WARNING: inflate ended prematurely\n");
+    }
+end:
+    inflateEnd(&zs);
+    return size_read - zs.avail_in;
+}
+
+size_t copy_deflated_to_buffer(void *dst, size_t dst_size, FILE *src,
+                               size_t size_in)
+{
+    z_stream zs;
+    unsigned char buf_in[4096];
+    size_t chunk;
+    int res;
+
+    memset(&zs, 0, sizeof(zs));
+    res = inflateInit2(&zs, -15);
+    assert(res == Z_OK);
+    zs.next_out  = dst;
+    zs.avail_out = (uInt)dst_size;
+    res = Z_OK;
+    while (size_in > 0 && res == Z_OK && zs.avail_out > 0)
+    {
+        chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+        if (fread(buf_in, 1, chunk, src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        size_in -= chunk;
+
+        zs.next_in  = buf_in;
+        zs.avail_in = chunk;
+        res = inflate(&zs, Z_SYNC_FLUSH);
+        if (res == Z_BUF_ERROR) res = Z_OK;
+    }
+    if (res != Z_STREAM_END && zs.avail_out > 0)
+    {
+        fprintf(stderr, res == Z_OK ? "WARNING: inflate ended prematurely\n"
+                                    : "WARNING: inflate failed!\n");
+    }
+    inflateEnd(&zs);
+    skip_data(src, size_in);
+    return dst_size - zs.avail_out;
+}
+
+size_t decode_deflated_buffer( void *dst, size_t dst_size,
+                               const void *src, size_t src_size )
+{
+    z_stream zs;
+    int res;
+
+    memset(&zs, 0, sizeof(zs));
+    res = inflateInit2(&zs, -15);
+    assert(res == Z_OK);
+    zs.next_in   = (Bytef*)src;
+    zs.avail_in  = (uInt)src_size;
+    zs.next_out  = dst;
+    zs.avail_out = (uInt)dst_size;
+    res = inflate(&zs, Z_FINISH);
+    if (res != Z_STREAM_END)
+    {
+        fprintf(stderr, res == Z_BUF_ERROR && zs.avail_out == 0 ?
+                        "WARNING: inflated data exceeds recorded size\n" :
+                        "WARNING: inflate failed!\n");
+    }
+    inflateEnd(&zs);
+    return dst_size - zs.avail_out;
+}
+
+void find_deflate_points( FILE *src, size_t size_in, size_t span,
+                          void (*point)(void *arg, size_t decoded,
+                                        size_t stored, int bits,
+                                        const unsigned char *window),
+                          void *arg )
+{
+    z_stream zs;
+    unsigned char buf_in[16384], window[DEFLATE_WINDOW];
+    unsigned char linear[DEFLATE_WINDOW];
+    size_t chunk, total_in, total_out, last, left;
+    int res;
+
+    assert(span >= DEFLATE_WINDOW);
+    memset(&zs, 0, sizeof(zs));
+    res = inflateInit2(&zs, -15);
+    assert(res == Z_OK);
+
+    /* Decode into a circular window, one block at a time */
+    total_in = total_out = last = 0;
+    zs.next_out  = window;
+    zs.avail_out = sizeof(window);
+    while (size_in > 0 && res != Z_STREAM_END)
+    {
+        chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+        if (fread(buf_in, 1, chunk, src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        size_in -= chunk;
+
+        zs.next_in  = buf_in;
+        zs.avail_in = chunk;
+        do {
+            if (zs.avail_out == 0)
+            {
+                zs.next_out  = window;
+                zs.avail_out = sizeof(window);
+            }
+            total_in  += zs.avail_in;
+            total_out += zs.avail_out;
+            res = inflate(&zs, Z_BLOCK);
+            total_in  -= zs.avail_in;
+            total_out -= zs.avail_out;
+            if (res == Z_STREAM_END) break;
+            if (res != Z_OK && res != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "WARNING: inflate failed!\n");
+                goto end;
+            }
+
+            /* At the end of a block other than the last one? */
+            if ((zs.data_type & 128) && !(zs.data_type & 64) &&
+                total_out - last >= span)
+            {
+                left = zs.avail_out;
+                memcpy(linear, window + sizeof(window) - left, left);
+                memcpy(linear + left, window, sizeof(window) - left);
+                point(arg, total_out, total_in, zs.data_type & 7, linear);
+                last = total_out;
+            }
+        } while (zs.avail_in != 0);
+    }
+end:
+    inflateEnd(&zs);
+    skip_data(src, size_in);
+}
+
+size_t inflate_from( void *dst, size_t dst_size, size_t skip, FILE *src,
+                     size_t size_in, int bits, const unsigned char *window )
+{
+    z_stream zs;
+    unsigned char buf_in[16384], scratch[16384];
+    size_t chunk, avail, size_out;
+    int res, byte;
+
+    memset(&zs, 0, sizeof(zs));
+    res = inflateInit2(&zs, -15);
+    assert(res == Z_OK);
+    if (bits > 0)
+    {
+        if (size_in == 0 || (byte = getc(src)) == EOF)
+        {
+            perror("Read failed");
+            abort();
+        }
+        --size_in;
+        inflatePrime(&zs, bits, byte >> (8 - bits));
+    }
+    if (window != NULL) inflateSetDictionary(&zs, window, DEFLATE_WINDOW);
+
+    size_out = 0;
+    while (size_out < dst_size)
+    {
+        if (zs.avail_in == 0 && size_in > 0)
+        {
+            chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+            if (fread(buf_in, 1, chunk, src) != chunk)
+            {
+                perror("Read failed");
+                abort();
+            }
+            size_in -= chunk;
+            zs.next_in  = buf_in;
+            zs.avail_in = chunk;
+        }
+
+        /* Decode into scratch space until ``skip'' bytes are discarded */
+        if (skip > 0)
+        {
+            zs.next_out  = scratch;
+            zs.avail_out = skip < sizeof(scratch) ? skip : sizeof(scratch);
+        }
+        else
+        {
+            zs.next_out  = (Bytef*)dst + size_out;
+            zs.avail_out = (uInt)(dst_size - size_out);
+        }
+        avail = zs.avail_out;
+        res = inflate(&zs, Z_NO_FLUSH);
+        avail -= zs.avail_out;
+        if (skip > 0) skip -= avail; else size_out += avail;
+        if (res == Z_STREAM_END) break;
+        if (res == Z_BUF_ERROR && avail == 0 && size_in == 0) break;
+        if (res != Z_OK && res != Z_BUF_ERROR)
+        {
+            fprintf(stderr, "WARNING: inflate failed!\n");
+            break;
+        }
+    }
     inflateEnd(&zs);
     return size_out;
 }
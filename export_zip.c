@@ -0,0 +1,361 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Number of entries per worker thread that are processed in one batch.
+   Entries that must be recompressed are kept in a temporary spool file
+   until they have been written to the ZIP file. */
+#define BATCH_PER_WORKER 4
+
+/* ZIP compression methods */
+#define ZIP_STORED   0
+#define ZIP_DEFLATED 8
+
+struct Member
+{
+    uint32_t    offset;         /* Offset of local header in ZIP file */
+    uint16_t    method;         /* ZIP compression method */
+    uint32_t    crc;            /* CRC-32 of uncompressed data */
+    uint32_t    size;           /* Uncompressed size */
+    uint32_t    stored_size;    /* Compressed size */
+    FILE        *fp;            /* Spool file with recompressed data */
+    int         raw;            /* If nonzero, copy the archive data as-is */
+    int         skip;           /* If nonzero, leave out of ZIP file */
+};
+
+struct Export
+{
+    Archive         *ar;        /* Input archive */
+    FILE            **fp_in;    /* Input archive file (per worker) */
+    FILE            **fp_tmp;   /* Decompressed data spool (per worker) */
+    size_t          first;      /* Index of first entry in current batch */
+    struct Member   *members;   /* Members of ZIP file (one per entry) */
+};
+
+static FILE *create_spool()
+{
+    FILE *fp = tmpfile();
+
+    if (fp == NULL)
+    {
+        perror("Could not create spool file");
+        abort();
+    }
+    return fp;
+}
+
+/* Computes the CRC-32 of the next ``size'' bytes of src. */
+static uint32_t crc_file(FILE *src, size_t size)
+{
+    unsigned char buffer[65536];
+    uLong crc = crc32(0, Z_NULL, 0);
+    size_t chunk;
+
+    while (size > 0)
+    {
+        chunk = size > sizeof(buffer) ? sizeof(buffer) : size;
+        if (fread(buffer, 1, chunk, src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        crc = crc32(crc, buffer, (uInt)chunk);
+        size -= chunk;
+    }
+    return (uint32_t)crc;
+}
+
+/* Prepares a single entry for writing: computes the CRC-32 of its data and,
+   for LZMA compressed entries, deflates the data into the member's spool.
+   Deflated data is only decoded to compute its checksum. */
+static void export_entry(void *arg, size_t j, int worker)
+{
+    struct Export *ex = arg;
+    size_t i = ex->first + j;
+    struct Member *m = &ex->members[i];
+    const IndexEntry *e = &ex->ar->entries[i];
+    FILE *fp_in = ex->fp_in[worker], *fp_tmp = ex->fp_tmp[worker];
+    size_t size;
+
+    if (fseek(fp_in, (long)e->offset, SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+
+    switch (e->compression)
+    {
+    case COM_NONE:
+        m->raw    = 1;
+        m->method = ZIP_STORED;
+        m->crc    = crc_file(fp_in, e->stored_size);
+        m->size   = e->stored_size;
+        m->stored_size = e->stored_size;
+        break;
+
+    case COM_DEFLATE:
+        m->raw    = 1;
+        m->method = ZIP_DEFLATED;
+        m->size   = (uint32_t)crc_deflated(fp_in, e->stored_size, &m->crc);
+        m->stored_size = e->stored_size;
+        break;
+
+    case COM_LZMA:
+        rewind(fp_tmp);
+        size = copy_lzmad(fp_tmp, fp_in, e->stored_size);
+        rewind(fp_tmp);
+        m->crc  = crc_file(fp_tmp, size);
+        m->size = (uint32_t)size;
+        if (m->fp == NULL) m->fp = create_spool();
+        rewind(fp_tmp);
+        m->method = ZIP_DEFLATED;
+        m->stored_size = (uint32_t)copy_deflatec(m->fp, fp_tmp, size);
+        if (m->stored_size >= size)
+        {
+            rewind(fp_tmp);
+            rewind(m->fp);
+            m->method = ZIP_STORED;
+            m->stored_size = (uint32_t)copy_uncompressed(m->fp, fp_tmp, size);
+        }
+        break;
+
+    default:
+        m->skip = 1;
+        return;
+    }
+
+    if (m->size != e->size)
+    {
+        fprintf(stderr, "WARNING: decoded size (%ld bytes) of entry %ld "
+                        "differs from recorded size (%ld bytes)\n",
+                        (long)m->size, (long)i, (long)e->size);
+    }
+}
+
+/* Returns the MS-DOS time (low 16 bits) and date (high 16 bits) of the
+   modification time of the given file, or of the current time. */
+static uint32_t dos_time(const char *path)
+{
+    struct stat st;
+    struct tm *tm;
+    time_t t;
+
+    t = stat(path, &st) == 0 ? st.st_mtime : time(NULL);
+    tm = localtime(&t);
+    if (tm == NULL || tm->tm_year < 80) return (1 << 21) | (1 << 16);
+    return ((uint32_t)(tm->tm_year - 80) << 25) |
+           ((uint32_t)(tm->tm_mon + 1) << 21) | ((uint32_t)tm->tm_mday << 16) |
+           ((uint32_t)tm->tm_hour << 11) | ((uint32_t)tm->tm_min << 5) |
+           ((uint32_t)tm->tm_sec >> 1);
+}
+
+/* Returns the path of entry i as stored in the ZIP file, which omits the
+   leading ``./'' of files in the root directory. */
+static const char *member_path(const Archive *ar, size_t i, char path[PATH_LEN])
+{
+    entry_path(ar, i, path);
+    return path[0] == '.' && path[1] == '/' ? path + 2 : path;
+}
+
+static void write_bytes(FILE *fp, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, fp) != size)
+    {
+        perror("Write failed");
+        abort();
+    }
+}
+
+/* Writes the fields shared by local file headers and central directory
+   headers, from the version needed to extract up to the file name length */
+static void put_member(unsigned char *buf, const struct Member *m,
+                       uint32_t mtime, size_t name_len)
+{
+    put_uint16(buf +  0, 20);           /* version needed to extract */
+    put_uint16(buf +  2, 0);            /* general purpose bit flag */
+    put_uint16(buf +  4, m->method);
+    put_uint32(buf +  6, mtime);
+    put_uint32(buf + 10, m->crc);
+    put_uint32(buf + 14, m->stored_size);
+    put_uint32(buf + 18, m->size);
+    put_uint16(buf + 22, (uint16_t)name_len);
+    put_uint16(buf + 24, 0);            /* extra field length */
+}
+
+void export_zip(const char *archive_path, const char *zip_path)
+{
+    struct Export ex;
+    Archive *ar;
+    FILE *fp;
+    unsigned char header[46];
+    char buf[PATH_LEN];
+    const char *path;
+    size_t i, count, batch, len, members;
+    uint32_t mtime;
+    unsigned long pos, cd_pos;
+    int w, workers;
+
+    ar = open_archive(archive_path);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", archive_path);
+        exit(1);
+    }
+    if (ar->entries_size > 0xffff)
+    {
+        fprintf(stderr, "%s: too many files for a ZIP file.\n", archive_path);
+        exit(1);
+    }
+
+    if (strcmp(zip_path, "-") == 0)
+    {
+        fp = stdout;
+        fp_msg = stderr;
+    }
+    else
+    {
+        fp = fopen(zip_path, "wb");
+        fp_msg = stdout;
+    }
+    if (fp == NULL)
+    {
+        perror(zip_path);
+        exit(1);
+    }
+    mtime = dos_time(archive_path);
+
+    /* Allocate per-worker files and per-entry members */
+    workers = num_workers();
+    batch   = (size_t)workers*BATCH_PER_WORKER;
+    ex.ar       = ar;
+    ex.fp_in    = malloc(sizeof(FILE*)*workers);
+    ex.fp_tmp   = malloc(sizeof(FILE*)*workers);
+    ex.members  = calloc(ar->entries_size + 1, sizeof(struct Member));
+    if (ex.fp_in == NULL || ex.fp_tmp == NULL || ex.members == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    for (w = 0; w < workers; ++w)
+    {
+        ex.fp_in[w] = fopen(archive_path, "rb");
+        if (ex.fp_in[w] == NULL)
+        {
+            perror(archive_path);
+            abort();
+        }
+        ex.fp_tmp[w] = create_spool();
+    }
+
+    /* Write local file headers and data */
+    pos = 0;
+    members = 0;
+    for (ex.first = 0; ex.first < ar->entries_size; ex.first += count)
+    {
+        count = ar->entries_size - ex.first;
+        if (count > batch) count = batch;
+
+        /* Compute checksums and recompress entries in parallel */
+        run_parallel(count, export_entry, &ex);
+
+        for (i = ex.first; i < ex.first + count; ++i)
+        {
+            struct Member *m = &ex.members[i];
+
+            path = member_path(ar, i, buf);
+            if (m->skip)
+            {
+                fprintf(stderr, "%s: unknown compression method; skipped.\n",
+                                path);
+                continue;
+            }
+            if (pos + 30 + strlen(path) + m->stored_size > 0xfffffffful)
+            {
+                fprintf(stderr, "%s: ZIP file too large.\n", zip_path);
+                exit(1);
+            }
+
+            fprintf(fp_msg, "%s %s...\n", m->raw ? "Copying" : "Compressing",
+                            path);
+            len = strlen(path);
+            m->offset = (uint32_t)pos;
+            put_uint32(header, 0x04034b50ul);
+            put_member(header + 4, m, mtime, len);
+            write_bytes(fp, header, 30);
+            write_bytes(fp, path, len);
+            if (m->raw)
+            {
+                seek_entry(ar, i);
+                copy_raw(fp, ar->fp, m->stored_size);
+            }
+            else
+            {
+                rewind(m->fp);
+                copy_uncompressed(fp, m->fp, m->stored_size);
+                fclose(m->fp);
+                m->fp = NULL;
+            }
+            pos += 30 + len + m->stored_size;
+            ++members;
+        }
+    }
+
+    /* Write central directory */
+    cd_pos = pos;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        const struct Member *m = &ex.members[i];
+
+        if (m->skip) continue;
+        path = member_path(ar, i, buf);
+        len = strlen(path);
+        put_uint32(header, 0x02014b50ul);
+        put_uint16(header + 4, 20);     /* version made by */
+        put_member(header + 6, m, mtime, len);
+        put_uint16(header + 32, 0);     /* file comment length */
+        put_uint16(header + 34, 0);     /* disk number start */
+        put_uint16(header + 36, 0);     /* internal file attributes */
+        put_uint32(header + 38, 0);     /* external file attributes */
+        put_uint32(header + 42, m->offset);
+        write_bytes(fp, header, 46);
+        write_bytes(fp, path, len);
+        pos += 46 + len;
+    }
+    if (pos > 0xfffffffful)
+    {
+        fprintf(stderr, "%s: ZIP file too large.\n", zip_path);
+        exit(1);
+    }
+
+    /* Write end of central directory record */
+    put_uint32(header,      0x06054b50ul);
+    put_uint16(header +  4, 0);         /* number of this disk */
+    put_uint16(header +  6, 0);         /* disk with central directory */
+    put_uint16(header +  8, (uint16_t)members);
+    put_uint16(header + 10, (uint16_t)members);
+    put_uint32(header + 12, (uint32_t)(pos - cd_pos));
+    put_uint32(header + 16, (uint32_t)cd_pos);
+    put_uint16(header + 20, 0);         /* comment length */
+    write_bytes(fp, header, 22);
+
+    if (fp != stdout ? fclose(fp) != 0 : fflush(fp) != 0)
+    {
+        perror("Write failed");
+        abort();
+    }
+
+    for (w = 0; w < workers; ++w)
+    {
+        fclose(ex.fp_in[w]);
+        fclose(ex.fp_tmp[w]);
+    }
+    free(ex.fp_in);
+    free(ex.fp_tmp);
+    free(ex.members);
+    close_archive(ar);
+}
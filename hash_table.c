@@ -0,0 +1,209 @@
+#include "common.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct HashEntry
+{
+    char        *key;           /* Copy of key (NULL if slot is empty) */
+    uint32_t    hash;           /* Hash of key */
+    size_t      value;          /* Associated value */
+};
+
+struct HashTable
+{
+    int                 ignore_case;
+    size_t              size, capacity;
+    struct HashEntry    *slots;
+};
+
+/* Byte-wise constants for fold_word() */
+#define ONES    0x0101010101010101ull
+#define HIGHS   0x8080808080808080ull
+
+/* Converts the ASCII upper-case letters among the 8 bytes of ``w'' to lower
+   case, handling all bytes at once: bit 7 of each byte is set in ``ge_a''
+   if its low 7 bits are at least 'A', and in ``gt_z'' if they exceed 'Z'.
+   Bytes with bit 7 set are not letters and are left alone. */
+static uint64_t fold_word(uint64_t w)
+{
+    uint64_t low7, ge_a, gt_z;
+
+    low7 = w & ~HIGHS;
+    ge_a = low7 + (0x80 - 'A')*ONES;
+    gt_z = low7 + (0x80 - 'Z' - 1)*ONES;
+    return w | ((ge_a & ~gt_z & ~w & HIGHS) >> 2);
+}
+
+/* Returns the ASCII lower-case version of character c (like tolower() in
+   the C locale, but independent of the current locale) */
+static int fold_char(int c)
+{
+    return c | ((unsigned)(c - 'A') < 26u) << 5;
+}
+
+/* Loads ``len'' (at most 8) bytes as a little-endian word */
+static uint64_t load_word(const unsigned char *p, size_t len)
+{
+    uint64_t w = 0;
+
+    while (len-- > 0) w = w << 8 | p[len];
+    return w;
+}
+
+uint32_t hash_string(const char *str, int ignore_case)
+{
+    const unsigned char *p = (const unsigned char*)str;
+    size_t len = strlen(str), n;
+    uint64_t hash = len, w;
+
+    /* Mix in 8 bytes at a time; the last word is padded with zeroes */
+    for (n = 0; n < len; n += 8)
+    {
+        w = load_word(p + n, len - n < 8 ? len - n : 8);
+        if (ignore_case) w = fold_word(w);
+        hash = (hash ^ w)*0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+
+    /* Finalize, so all bits of the hash depend on all bits of the input */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+int compare_strings(const char *a, const char *b, int ignore_case)
+{
+    int ca, cb;
+
+    if (!ignore_case) return strcmp(a, b);
+    do {
+        ca = fold_char((unsigned char)*a++);
+        cb = fold_char((unsigned char)*b++);
+    } while (ca == cb && ca != '\0');
+    return ca - cb;
+}
+
+int compare_prefix(const char *a, const char *b, size_t len, int ignore_case)
+{
+    int ca = 0, cb = 0;
+
+    while (len-- > 0)
+    {
+        ca = (unsigned char)*a++;
+        cb = (unsigned char)*b++;
+        if (ignore_case)
+        {
+            ca = fold_char(ca);
+            cb = fold_char(cb);
+        }
+        if (ca != cb || ca == '\0') break;
+    }
+    return ca - cb;
+}
+
+HashTable *create_hash_table(int ignore_case)
+{
+    HashTable *ht;
+
+    ht = malloc(sizeof(HashTable));
+    assert(ht != NULL);
+    ht->ignore_case = ignore_case;
+    ht->size        = 0;
+    ht->capacity    = 0;
+    ht->slots       = NULL;
+    return ht;
+}
+
+void free_hash_table(HashTable *ht)
+{
+    size_t i;
+
+    for (i = 0; i < ht->capacity; ++i) free(ht->slots[i].key);
+    free(ht->slots);
+    free(ht);
+}
+
+/* Returns the slot for the given key: either the slot containing the key,
+   or the empty slot where it should be inserted. */
+static struct HashEntry *find_slot(const HashTable *ht, const char *key,
+                                   uint32_t hash)
+{
+    size_t i;
+    struct HashEntry *e;
+
+    for (i = hash & (ht->capacity - 1); ; i = (i + 1) & (ht->capacity - 1))
+    {
+        e = &ht->slots[i];
+        if (e->key == NULL) return e;
+        if (e->hash == hash &&
+            compare_strings(e->key, key, ht->ignore_case) == 0) return e;
+    }
+}
+
+static void grow(HashTable *ht)
+{
+    struct HashEntry *old_slots = ht->slots, *e;
+    size_t i, old_capacity = ht->capacity;
+
+    ht->capacity = old_capacity > 0 ? 2*old_capacity : 64;
+    ht->slots = malloc(sizeof(struct HashEntry)*ht->capacity);
+    assert(ht->slots != NULL);
+    for (i = 0; i < ht->capacity; ++i) ht->slots[i].key = NULL;
+
+    for (i = 0; i < old_capacity; ++i)
+    {
+        if (old_slots[i].key == NULL) continue;
+        e = find_slot(ht, old_slots[i].key, old_slots[i].hash);
+        *e = old_slots[i];
+    }
+    free(old_slots);
+}
+
+size_t hash_lookup(const HashTable *ht, const char *key)
+{
+    return hash_lookup_hashed(ht, key, hash_string(key, ht->ignore_case));
+}
+
+size_t hash_insert(HashTable *ht, const char *key, size_t value)
+{
+    return hash_insert_hashed(ht, key, hash_string(key, ht->ignore_case),
+                              value);
+}
+
+size_t hash_lookup_hashed(const HashTable *ht, const char *key, uint32_t hash)
+{
+    struct HashEntry *e;
+
+    if (ht->size == 0) return (size_t)-1;
+    e = find_slot(ht, key, hash);
+    return e->key != NULL ? e->value : (size_t)-1;
+}
+
+size_t hash_insert_hashed( HashTable *ht, const char *key, uint32_t hash,
+                           size_t value )
+{
+    struct HashEntry *e;
+    size_t old_value, len;
+
+    /* Keep load factor below 1/2 */
+    if (2*(ht->size + 1) > ht->capacity) grow(ht);
+
+    e = find_slot(ht, key, hash);
+    if (e->key != NULL)
+    {
+        old_value = e->value;
+        e->value = value;
+        return old_value;
+    }
+
+    len = strlen(key);
+    e->key = malloc(len + 1);
+    assert(e->key != NULL);
+    memcpy(e->key, key, len + 1);
+    e->hash  = hash;
+    e->value = value;
+    ht->size++;
+    return (size_t)-1;
+}
@@ -9,27 +9,37 @@
 #include <unistd.h>
 
 #ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
 #define mkdir(path,mode) mkdir(path)
 #endif
 
 extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
 
-enum Mode { LIST, EXTRACT, CREATE };
+enum Mode { LIST, EXTRACT, CAT, CREATE, RECOMPRESS, REPACK, MERGE, DIFF,
+            APPLY, COMPARE, EXPORT_ZIP, CONVERT, VERIFY, INDEX };
 
 static enum Mode arg_mode;              /* Mode of operation */
 static char *arg_archive;               /* Path to archive */
-static char **arg_files_begin,          /* List of filesto process */
+static char *arg_archive2;              /* Path to second input archive */
+static char *arg_output;                /* Path to output archive */
+static int arg_lzma_size = -1;          /* Convert to LZMA size variant */
+static char *arg_tar;                   /* Path to tar file to read/write */
+static char **arg_files_begin,          /* List of files to process */
             **arg_files_end;
-static Compression arg_com;             /* Compression to use */
+static char *arg_containers;            /* Which files are containers */
+static char *arg_path;                  /* Path of file in archive */
+static int arg_index;                   /* Write lookup index for output */
+static char *arg_dir;                   /* Directory to list (NULL: all) */
+static Compression arg_com = COM_LZMA;  /* Compression to use */
 
-static FILE *fp;                /* File pointer */
-static size_t file_size;        /* Size of file */
+static FILE *fp_tar;    /* Tar stream that extracted files are written to */
 
-static char *strings;           /* String table */
-static size_t strings_size;     /* Size of string table */
+/* Number of entries per worker thread that are extracted in one batch */
+#define EXTRACT_BATCH_PER_WORKER 16
 
-static IndexEntry *entries;     /* Index entries */
-static size_t entries_size;     /* Number of index entries */
+/* Maximum amount of decoded data buffered when writing a tar stream */
+#define TAR_WINDOW_SIZE (16 << 20)
 
 static void create_dir(char *path)
 {
@@ -55,193 +65,559 @@ static void create_dir(char *path)
     }
 }
 
-static uint32_t read_uint32()
+static void list_header()
 {
-    uint8_t bytes[4];
+    printf( "Com   Offset       Size     Stored Size "
+            " File path                    \n" );
+
+    printf( "--- ----------- ----------- ----------- "
+            "---------------------------------------\n" );
+}
+
+static void list_entry(const Archive *ar, size_t i)
+{
+    printf( " %ld  %10ld  %10ld  %10ld   %s\n",
+            (long)ar->entries[i].compression, (long)ar->offsets[i],
+            (long)ar->sizes[i], (long)ar->stored_sizes[i],
+            entry_full_path(ar, i) );
+}
+
+static void list_footer()
+{
+    printf( "--- ----------- ----------- ----------- "
+            "---------------------------------------\n" );
+}
 
-    if (fread(bytes, 4, 1, fp) != 1)
+/* Returns whether entry i lies in directory arg_dir (if given) */
+static int in_listed_dir(const Archive *ar, size_t i)
+{
+    const char *path;
+    size_t len;
+
+    if (arg_dir == NULL) return 1;
+    path = entry_full_path(ar, i);
+    len  = strlen(arg_dir);
+    return compare_prefix(path, arg_dir, len, 1) == 0 && path[len] == '/';
+}
+
+/* Lists the entries of an archive, or those in directory arg_dir, which
+   are found by binary search if the archive is sorted. */
+static void list_entries(Archive *ar)
+{
+    char prefix[PATH_LEN];
+    size_t i, begin = 0, end = ar->entries_size;
+    int scan = arg_dir != NULL;
+
+    load_paths(ar);
+    if (arg_dir != NULL && strlen(arg_dir) + 2 <= PATH_LEN)
     {
-        perror("Read failed");
-        abort();
+        sprintf(prefix, "%s/", arg_dir);
+        if (prefix_range(ar, prefix, &begin, &end)) scan = 0;
     }
 
-    return ((uint32_t)bytes[0] <<  0) | ((uint32_t)bytes[1] <<  8) |
-           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    list_header();
+    for (i = begin; i < end; ++i)
+    {
+        if (!scan || in_listed_dir(ar, i)) list_entry(ar, i);
+    }
+    list_footer();
 }
 
-static void open_archive(const char *path)
+/* Lists the resolved entries of an overlay. Offsets refer to the archive
+   containing the entry, which is listed before the first of its entries. */
+static void list_overlay_entries(const Overlay *ov)
 {
-    long lpos;
+    size_t j;
+    const Archive *last = NULL;
 
-    /* Open file */
-    fp = fopen(path, "rb");
-    if (fp == NULL)
+    list_header();
+    for (j = 0; j < ov->entries_size; ++j)
     {
-        perror("Could not open archive file");
-        abort();
+        if (!in_listed_dir(ov->entries[j].ar, ov->entries[j].entry)) continue;
+        if (ov->entries[j].ar != last)
+        {
+            last = ov->entries[j].ar;
+            printf("[%s]\n", last->path);
+        }
+        list_entry(ov->entries[j].ar, ov->entries[j].entry);
     }
+    list_footer();
+}
 
-    /* Seek to end to determine file size */
-    if (fseek(fp, 0, SEEK_END) == -1 || (lpos = ftell(fp)) == -1)
+/* Prints the progress message for extracting entry i. */
+static void announce_entry(const Archive *ar, size_t i)
+{
+    char path[PATH_LEN];
+
+    entry_path(ar, i, path);
+    switch (ar->entries[i].compression)
     {
-        perror("Could not determine file size");
-        abort();
+    case COM_NONE:
+        fprintf(fp_msg, "Extracting %s (uncompressed)\n", path);
+        break;
+
+    case COM_DEFLATE:
+        fprintf(fp_msg, "Extracting %s (deflated)\n", path);
+        break;
+
+    case COM_LZMA:
+        fprintf(fp_msg, "Extracting %s (LZMA compressed)\n", path);
+        break;
+    }
+}
+
+/* Writes the file for entry i, reading its data from the current position
+   of src. Safe to call from multiple threads for different files. */
+static void write_entry_file(const Archive *ar, size_t i, FILE *src)
+{
+    char path[PATH_LEN];
+    const char *dir_name;
+    const unsigned char *data;
+    size_t size_new;
+    const IndexEntry *entries = ar->entries;
+
+    dir_name = strat(ar, entries[i].dir_name);
+    if (*dir_name != '\0')
+    {
+        assert(strlen(dir_name) < sizeof(path));
+        strcpy(path, dir_name);
+        create_dir(path);
+    }
+    entry_path(ar, i, path);
+
+    /* Check stored data against the archive's checksums, if available */
+    if (ar->checksums != NULL && (data = entry_data(ar, i)) != NULL &&
+        crc32c(0, data, entries[i].stored_size) != ar->checksums[i].stored)
+    {
+        fprintf(stderr, "WARNING: checksum of stored data of %s differs\n",
+                        path);
+    }
+
+    size_new = extract_file(path, src, &entries[i]);
+    if (size_new == (size_t)-1) return;
+
+    if (size_new != entries[i].size)
+    {
+        fprintf(stderr, "WARNING: extracted size (%ld bytes) differs from "
+                        "recorded size (%ld bytes)\n",
+                        (long)size_new, (long)entries[i].size);
     }
-    fseek(fp, 0, SEEK_SET);
-    file_size = (size_t)lpos;
 }
 
-static void close_archive()
+/* Extracts entry i, reading its data from the current position of src. */
+static void extract_entry(const Archive *ar, size_t i, FILE *src)
 {
-    fclose(fp);
+    if (fp_tar != NULL)
+    {
+        write_tar_entry(fp_tar, ar, i, src);
+        return;
+    }
+
+    announce_entry(ar, i);
+    write_entry_file(ar, i, src);
 }
 
-static void process_header()
+static int skip_entry(const Archive *ar, size_t i)
 {
-    if (read_uint32() != 0xac2ff34ful)
+    char path[PATH_LEN];
+
+    if (ar->codecs[i] > COM_LZMA)
     {
-        fprintf(stderr, "The specified file does not seem to be a "
-                        "Hothead Archive file.\n");
-        exit(1);
+        entry_path(ar, i, path);
+        fprintf(fp_msg, "Skipping %s (compression type %d unknown)\n",
+                        path, ar->entries[i].compression);
+        return 1;
     }
-    (void)read_uint32();
-    strings_size = read_uint32();
-    entries_size = read_uint32();
-    assert( strings_size <= file_size - sizeof(Header) );
-    assert( entries_size <= (file_size - strings_size - sizeof(Header)) /
-                             sizeof(IndexEntry) );
+    return 0;
+}
+
+static void extract_entries(Archive *ar)
+{
+    size_t i;
 
-    /* Allocate and read string table */
-    strings = malloc(strings_size + 1);
-    if (strings == NULL)
+    for (i = 0; i < ar->entries_size; ++i)
     {
-        perror("Could not allocate memory for string table");
-        abort();
+        if (skip_entry(ar, i)) continue;
+
+        seek_entry(ar, i);
+        extract_entry(ar, i, ar->fp);
     }
-    if (fread(strings, 1, strings_size, fp) != strings_size)
+}
+
+struct Extraction
+{
+    Archive     *ar;            /* Archive being extracted */
+    FILE        **fp_in;        /* Archive file (per worker) */
+    size_t      *batch;         /* Indices of entries in current batch */
+};
+
+static void extract_batch_entry(void *arg, size_t j, int worker)
+{
+    struct Extraction *ex = arg;
+    size_t i = ex->batch[j];
+    FILE *fp_in = ex->fp_in[worker];
+
+    if (fseek(fp_in, (long)ex->ar->entries[i].offset, SEEK_SET) == -1)
     {
-        perror("Could not read string table");
+        perror("Seek failed");
         abort();
     }
-    strings[strings_size] = '\0';   /* zero-terminate strings table */
+    write_entry_file(ex->ar, i, fp_in);
+}
+
+/* Extracts entries using multiple worker threads, each reading from its
+   own handle to the archive, so the latency of opening, writing and
+   closing many small files overlaps with decoding. Entries are processed
+   in batches; progress messages for a batch are printed, and the system is
+   advised to read its data ahead, before it is extracted. If several
+   entries have the same path, only the last one is extracted, since it
+   would overwrite the others anyway. */
+static void extract_entries_parallel(Archive *ar)
+{
+    struct Extraction ex;
+    Reader *rd;
+    HashTable *paths;
+    size_t i, count, batch_size;
+    int w, workers;
 
-    /* Allocate and read index */
-    entries = malloc(sizeof(IndexEntry)*entries_size);
-    if (entries == NULL)
+    load_paths(ar);
+    paths = create_hash_table(0);
+    for (i = 0; i < ar->entries_size; ++i)
     {
-        perror("Could not allocate memory for string table");
-        abort();
+        hash_insert(paths, entry_full_path(ar, i), i);
     }
-    if (fread(entries, sizeof(IndexEntry), entries_size, fp) != entries_size)
+
+    workers    = num_workers();
+    batch_size = (size_t)workers*EXTRACT_BATCH_PER_WORKER;
+    ex.ar    = ar;
+    ex.fp_in = malloc(sizeof(FILE*)*workers);
+    ex.batch = malloc(sizeof(size_t)*batch_size);
+    if (ex.fp_in == NULL || ex.batch == NULL)
     {
-        perror("Could not read index entries");
+        perror("Could not allocate memory");
         abort();
     }
-}
+    for (w = 0; w < workers; ++w)
+    {
+        ex.fp_in[w] = fopen(ar->path, "rb");
+        if (ex.fp_in[w] == NULL)
+        {
+            perror(ar->path);
+            abort();
+        }
+    }
 
-static const char *strat(size_t pos)
-{
-    assert(pos <= strings_size);
-    return strings + pos;
+    rd = open_reader(ar);
+    for (i = 0; i < ar->entries_size; )
+    {
+        for (count = 0; count < batch_size && i < ar->entries_size; ++i)
+        {
+            if (hash_lookup(paths, entry_full_path(ar, i)) != i ||
+                skip_entry(ar, i)) continue;
+            announce_entry(ar, i);
+            ex.batch[count++] = i;
+        }
+        prefetch_entries(rd, ex.batch, count);
+        run_parallel(count, extract_batch_entry, &ex);
+    }
+    close_reader(rd);
+
+    for (w = 0; w < workers; ++w) fclose(ex.fp_in[w]);
+    free(ex.fp_in);
+    free(ex.batch);
+    free_hash_table(paths);
 }
 
-static void list_entries()
+static void extract_overlay_entries(const Overlay *ov)
 {
-    size_t i;
-    char path[1024];
-    const char *dir_name, *file_name;
+    size_t j;
+    const OverlayEntry *oe;
 
-    printf( "Com   Offset       Size     Stored Size "
-            " File path                    \n" );
+    for (j = 0; j < ov->entries_size; ++j)
+    {
+        oe = &ov->entries[j];
+        if (skip_entry(oe->ar, oe->entry)) continue;
 
-    printf( "--- ----------- ----------- ----------- "
-            "---------------------------------------\n" );
+        seek_entry(oe->ar, oe->entry);
+        extract_entry(oe->ar, oe->entry, oe->ar->fp);
+    }
+}
+
+/* Writes entry i of ``ar'' to standard output; i is (size_t)-1 if the
+   path was not found. Uncompressed entries are written straight from a
+   mapping of the archive, if possible. */
+static int cat_entry(Archive *ar, size_t i, const char *path)
+{
+    const IndexEntry *e;
+    const unsigned char *data;
+    size_t size;
 
-    for (i = 0; i < entries_size; ++i)
+    if (i == (size_t)-1)
+    {
+        fprintf(stderr, "%s: no such file in archive.\n", path);
+        return 1;
+    }
+    e = &ar->entries[i];
+    if (e->compression > 2)
     {
-        dir_name  = strat(entries[i].dir_name);
-        file_name = strat(entries[i].file_name);
+        fprintf(stderr, "%s: compression type %d unknown.\n",
+                        path, e->compression);
+        return 1;
+    }
 
-        assert(strlen(dir_name) + 1 + strlen(file_name) < sizeof(path));
-        sprintf(path, "%s/%s", dir_name, file_name);
-        printf( " %ld  %10ld  %10ld  %10ld   %s\n",
-                (long)entries[i].compression, (long)entries[i].offset,
-                (long)entries[i].size, (long)entries[i].stored_size, path );
+#ifdef WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (map_archive(ar) && (data = entry_view(ar, i, &size)) != NULL)
+    {
+        if (fwrite(data, 1, size, stdout) != size)
+        {
+            perror("Write failed");
+            abort();
+        }
     }
+    else
+    {
+        seek_entry(ar, i);
+        size = decode_entry(stdout, ar->fp, e);
+    }
+    fflush(stdout);
+    if (size != e->size)
+    {
+        fprintf(stderr, "WARNING: extracted size (%ld bytes) differs from "
+                        "recorded size (%ld bytes)\n",
+                        (long)size, (long)e->size);
+    }
+    return 0;
+}
 
-    printf( "--- ----------- ----------- ----------- "
-            "---------------------------------------\n" );
+static Archive *sort_ar;    /* Archive being sorted by cmp_entry_offset() */
+
+static int cmp_entry_offset(const void *a, const void *b)
+{
+    size_t i = *(const size_t*)a, j = *(const size_t*)b;
+    const uint32_t *offsets = sort_ar->offsets;
+
+    if (offsets[i] != offsets[j]) return offsets[i] < offsets[j] ? -1 : 1;
+    return i < j ? -1 : i > j ? 1 : 0;
 }
 
-static void extract_entries()
+/* Extracts entries from an archive that cannot be seeked (e.g. a pipe). Data
+   is read strictly forward, so entries are processed in order of ascending
+   offset. Entries sharing an offset are spooled to a temporary file first,
+   so they can be decoded more than once. */
+static void extract_entries_sequentially(Archive *ar)
 {
-    size_t i;
-    char path[1024];
-    const char *dir_name, *file_name;
-    FILE *fp_new;
-    size_t size_new;
+    char path[PATH_LEN];
+    size_t *order, n, i, j, k, spool_size;
+    FILE *fp, *fp_spool;
+    const IndexEntry *entries = ar->entries;
 
-    for (i = 0; i < entries_size; ++i)
+    order = malloc(sizeof(size_t)*ar->entries_size);
+    if (order == NULL && ar->entries_size > 0)
     {
-        dir_name  = strat(entries[i].dir_name);
-        file_name = strat(entries[i].file_name);
+        perror("Could not allocate memory for index order");
+        abort();
+    }
+    for (n = 0; n < ar->entries_size; ++n) order[n] = n;
+    sort_ar = ar;
+    qsort(order, n, sizeof(size_t), cmp_entry_offset);
+
+    fp = ar->fp;
+    fp_spool = NULL;
+    for (i = 0; i < n; i = j)
+    {
+        /* Find group of entries [i:j) sharing the same offset */
+        spool_size = entries[order[i]].stored_size;
+        for (j = i + 1; j < n &&
+             entries[order[j]].offset == entries[order[i]].offset; ++j)
+        {
+            if (entries[order[j]].stored_size > spool_size)
+            {
+                spool_size = entries[order[j]].stored_size;
+            }
+        }
 
-        if (entries[i].compression > 2)
+        if (entries[order[i]].offset < ar->pos)
         {
-            printf("Skipping %s/%s (compression type %d unknown)\n",
-                   dir_name, file_name, entries[i].compression);
+            for (k = i; k < j; ++k)
+            {
+                entry_path(ar, order[k], path);
+                fprintf(stderr, "Skipping %s (overlaps previous data)\n",
+                        path);
+            }
             continue;
         }
 
-        assert(strlen(dir_name) + 1 + strlen(file_name) < sizeof(path));
-        strncpy(path, dir_name, sizeof(path));
-        create_dir(path);
-        strncat(path, "/", sizeof(path) - 1);
-        strncat(path, file_name, sizeof(path) - 1);
+        /* Skip padding and gaps */
+        ar->pos += skip_data(fp, entries[order[i]].offset - ar->pos);
 
-        fp_new = fopen(path, "wb");
-        if (fp_new == NULL)
+        if (j - i == 1)
         {
-            perror("Could not open file");
+            if (skip_entry(ar, order[i]))
+            {
+                ar->pos += skip_data(fp, entries[order[i]].stored_size);
+            }
+            else
+            {
+                extract_entry(ar, order[i], fp);
+                ar->pos += entries[order[i]].stored_size;
+            }
             continue;
         }
 
-        if (fseek(fp, (long)entries[i].offset, SEEK_SET) == -1)
+        /* Copy shared data to spool file */
+        if (fp_spool == NULL && (fp_spool = tmpfile()) == NULL)
         {
-            perror("Seek failed");
+            perror("Could not create spool file");
             abort();
         }
+        rewind(fp_spool);
+        ar->pos += copy_uncompressed(fp_spool, fp, spool_size);
 
-        switch (entries[i].compression)
+        for (k = i; k < j; ++k)
         {
-        case COM_NONE:
-            printf("Extracting %s/%s (uncompressed)\n", dir_name, file_name);
-            size_new = copy_uncompressed(fp_new, fp, entries[i].stored_size);
-            break;
+            if (skip_entry(ar, order[k])) continue;
+            rewind(fp_spool);
+            extract_entry(ar, order[k], fp_spool);
+        }
+    }
 
-        case COM_DEFLATE:
-            printf("Extracting %s/%s (deflated)\n", dir_name, file_name);
-            size_new = copy_deflated(fp_new, fp, entries[i].stored_size);
-            break;
+    if (fp_spool != NULL) fclose(fp_spool);
+    free(order);
+}
 
-        case COM_LZMA:
-            printf("Extracting %s/%s (LZMA compressed)\n", dir_name, file_name);
-            size_new = copy_lzmad(fp_new, fp, entries[i].stored_size);
-            break;
+static void store_decoded_size(void *arg, size_t i, size_t size)
+{
+    (void)i;
+    *(size_t*)arg = size;
+}
+
+/* Writes the entries of a seekable archive to the tar stream in the same
+   order as extract_entries_sequentially(), skipping the same entries.
+   Entries small enough to be decoded in memory are decoded by a reader's
+   workers a window at a time, then written in order; larger entries are
+   decoded straight into the tar stream. */
+static void extract_entries_to_tar_async(Archive *ar)
+{
+    char path[PATH_LEN];
+    Reader *rd;
+    unsigned char *window;
+    size_t *order, *sizes, *window_pos, n, m, i, j, k, end, used, size;
+    const IndexEntry *entries = ar->entries;
 
-        default:
-            size_new = 0;
+    n = ar->entries_size;
+    order      = malloc(sizeof(size_t)*n + 1);
+    sizes      = malloc(sizeof(size_t)*n + 1);
+    window_pos = malloc(sizeof(size_t)*n + 1);
+    window     = malloc(TAR_WINDOW_SIZE);
+    if (order == NULL || sizes == NULL || window_pos == NULL ||
+        window == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    for (i = 0; i < n; ++i) order[i] = i;
+    sort_ar = ar;
+    qsort(order, n, sizeof(size_t), cmp_entry_offset);
+
+    /* Keep only entries that would be extracted reading forward */
+    end = ar->pos;
+    for (i = m = 0; i < n; i = j)
+    {
+        for (j = i + 1; j < n &&
+             entries[order[j]].offset == entries[order[i]].offset; ++j) { }
+
+        if (entries[order[i]].offset < end)
+        {
+            for (k = i; k < j; ++k)
+            {
+                entry_path(ar, order[k], path);
+                fprintf(stderr, "Skipping %s (overlaps previous data)\n",
+                        path);
+            }
+            continue;
+        }
+        for (k = i; k < j; ++k)
+        {
+            if (entries[order[k]].offset + entries[order[k]].stored_size > end)
+                end = entries[order[k]].offset + entries[order[k]].stored_size;
+            if (!skip_entry(ar, order[k])) order[m++] = order[k];
         }
+    }
 
-        fclose(fp_new);
+    rd = open_reader(ar);
+    for (i = 0; i < m; i = j)
+    {
+        /* Decode as many entries as fit in the window */
+        for (j = i, used = 0; j < m; ++j)
+        {
+            size = entries[order[j]].size;
+            if (size > decode_buffer_limit || size > TAR_WINDOW_SIZE - used)
+                break;
+            window_pos[j] = used;
+            used += size;
+            read_entry_async( rd, order[j], window + window_pos[j],
+                              store_decoded_size, &sizes[j] );
+        }
+        wait_reader(rd);
 
-        if (size_new != entries[i].size)
+        for (k = i; k < j; ++k)
         {
-            fprintf(stderr, "WARNING: extracted size (%ld bytes) differs from "
-                            "recorded size (%ld bytes)\n",
-                            size_new, (long)entries[i].size);
+            write_tar_entry_data( fp_tar, ar, order[k], window + window_pos[k],
+                                  sizes[k] == (size_t)-1 ? 0 : sizes[k] );
+        }
+        if (j == i)
+        {
+            seek_entry(ar, order[j]);
+            write_tar_entry(fp_tar, ar, order[j], ar->fp);
+            ++j;
         }
     }
+    close_reader(rd);
+
+    free(window);
+    free(window_pos);
+    free(sizes);
+    free(order);
+}
+
+/* Writes the entries of an archive to a tar file (or standard output, if
+   tar_path is "-") in order of ascending offset. Seekable archives are
+   decoded with multiple threads, if possible; others are read strictly
+   forward. */
+static void extract_to_tar(const char *archive_path, const char *tar_path)
+{
+    Archive *ar;
+
+    if (strcmp(tar_path, "-") == 0)
+    {
+        fp_tar = stdout;
+        fp_msg = stderr;
+#ifdef WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    else
+    {
+        fp_tar = fopen(tar_path, "wb");
+        if (fp_tar == NULL)
+        {
+            perror(tar_path);
+            exit(1);
+        }
+    }
+
+    ar = open_archive(archive_path);
+    if (ar->seekable && num_workers() > 1)
+        extract_entries_to_tar_async(ar);
+    else
+        extract_entries_sequentially(ar);
+    close_archive(ar);
+
+    end_tar(fp_tar);
+    if (fp_tar != stdout) fclose(fp_tar);
+    fp_tar = NULL;
 }
 
 static void usage()
@@ -250,35 +626,175 @@ static void usage()
 "\n"
 "Usage:\n"
 "\n"
-"  hha list [opts] <file>             -- List the contents of <file>.\n"
-"  hha t [opts] <file>\n"
+"  hha list [opts] <file>+            -- List the contents of <file>.\n"
+"  hha t [opts] <file>+\n"
+"  hha list [opts] --dir <dir> <file>+\n"
+"                                     -- List only files in directory <dir>\n"
+"                                        and its subdirectories.\n"
+"\n"
+"  hha extract [opts] <file>+         -- Extract all files from the archive\n"
+"  hha x [opts] <file>+                  into the current working directory.\n"
+"                                        If <file> is -, the archive is read\n"
+"                                        from standard input.\n"
+"  hha extract [opts] --to-tar <tar> <file>\n"
+"                                     -- Write all files to tar file <tar>\n"
+"                                        (or standard output, if <tar> is -)\n"
+"                                        in the order they are stored.\n"
+"\n"
+"  hha cat [opts] <file>+ <path>      -- Write the contents of the file at\n"
+"                                        <path> in the archive to standard\n"
+"                                        output.\n"
 "\n"
-"  hha extract [opts] <file>          -- Extract all files from the archive\n"
-"  hha x [opts] <file>                   into the current working directory.\n"
+"  If multiple archives are given, they are combined as an overlay: files in\n"
+"  later archives replace files with the same path in earlier ones.\n"
 "\n"
 "  hha create [opts] <file> <dir>+    -- Pack the specified directories into a\n"
-"  hha c [opts] <file> <dir>+            new archive.\n"
+"  hha c [opts] <file> <dir>+            new archive. If <file> is -, the\n"
+"                                        archive is written to standard output.\n"
+"                                        Instead of directories, .zip, .gz and\n"
+"                                        .lzma files may be given; their\n"
+"                                        compressed contents are copied into\n"
+"                                        the archive without recompressing.\n"
+"  hha create [opts] --from-tar <tar> <file>\n"
+"                                     -- Pack the files in tar file <tar> (or\n"
+"                                        standard input, if <tar> is -) into\n"
+"                                        a new archive.\n"
+"\n"
+"  hha recompress [opts] <in> <out>   -- Recompress all files in archive <in>\n"
+"                                        and write the result to <out>.\n"
+"\n"
+"  hha repack [opts] <in> <out> <pattern>+\n"
+"                                     -- Copy files matching any <pattern>\n"
+"                                        from <in> to a new archive <out>,\n"
+"                                        without recompressing them.\n"
+"                                        Patterns match the full path, ignoring\n"
+"                                        case; * matches any sequence of\n"
+"                                        characters and ? any single character.\n"
+"                                        Patterns starting with ! exclude files.\n"
 "\n"
-"  LZMA options: (used in extract and create mode)\n"
+"  hha merge [opts] <out> <in>+       -- Merge the input archives into a new\n"
+"                                        archive <out>, without recompressing.\n"
+"                                        Files in later archives replace files\n"
+"                                        with the same path in earlier ones.\n"
+"\n"
+"  hha compare [opts] <old> <new>     -- List files that were added (A),\n"
+"                                        removed (D) or changed (M) between\n"
+"                                        archives <old> and <new>.\n"
+"\n"
+"  hha index [opts] <file>+           -- Write a lookup index for each archive\n"
+"                                        <file>, named like <file> with\n"
+"                                        extension .hhx, which is used to\n"
+"                                        find files without reading all paths\n"
+"                                        while the archive is unchanged.\n"
+"                                        Access points for reading large\n"
+"                                        deflated files from any offset are\n"
+"                                        written to a file with extension\n"
+"                                        .hhp.\n"
+"\n"
+"  hha verify [opts] <file>           -- Check that all files in the archive\n"
+"                                        decode to their recorded sizes and\n"
+"                                        that their data is aligned and does\n"
+"                                        not overlap, without writing\n"
+"                                        anything. Exits with status 1 if\n"
+"                                        problems are found.\n"
+"\n"
+"  hha diff-pack <old> <new> <patch>  -- Create a patch archive containing\n"
+"                                        the differences between archives\n"
+"                                        <old> and <new>.\n"
+"\n"
+"  hha apply <old> <patch> <out>      -- Apply a patch archive to archive\n"
+"                                        <old>, writing the result to <out>.\n"
+"\n"
+"  hha export-zip [opts] <in> <zip>   -- Write the contents of archive <in>\n"
+"                                        to ZIP file <zip> (or standard\n"
+"                                        output, if <zip> is -). Deflated\n"
+"                                        files are copied without\n"
+"                                        recompressing.\n"
+"\n"
+"  hha convert --lzma-size=add <in> <out>\n"
+"  hha convert --lzma-size=remove <in> <out>\n"
+"                                     -- Add or remove the uncompressed size\n"
+"                                        in the headers of LZMA compressed\n"
+"                                        files (see -u), without\n"
+"                                        recompressing. The format of <in> is\n"
+"                                        detected automatically.\n"
+"\n"
+"  Archive options: (used in all modes that write an archive)\n"
+"    --checksums   Append CRC-32C checksums of the stored and decoded data\n"
+"                  of each file, which verify, extract and compare check\n"
+"    --index       Write a lookup index for the archive (see index)\n"
+"    --access-span=<n>\n"
+"                  Write access points (see index) every <n> MiB of\n"
+"                  decoded data (default: 1)\n"
+"    --sorted-index\n"
+"                  Sort the index by path (ignoring case), so files can be\n"
+"                  found by binary search; file data keeps its order\n"
+"    --align=<n>   Align uncompressed files to multiples of <n> bytes (a\n"
+"                  power of two; default: 16), e.g. 4096 for page-aligned\n"
+"                  files that can be mapped directly\n"
+"  Extraction options:\n"
+"    --mmap        Allocate each file at its final size and decode into a\n"
+"                  memory mapping of it\n"
+"    --drop-cache  Drop extracted data from the page cache after writing\n"
+"  LZMA options: (used in extract, verify and create mode)\n"
 "    -u  Omit uncompressed size from LZMA header\n"
-"  Compression options: (used in create mode only)\n"
+"  Compression options: (used in create and recompress mode)\n"
 "    -0  No compression\n"
 "    -1  Deflate compression\n"
 "    -2  LZMA compression (default)\n"
 "  Note that these values specify maximum compression; a lower value may be\n"
-"  selected if it yields an equal or smaller size.\n");
+"  selected if it yields an equal or smaller size.\n"
+"  Other options:\n"
+"    -j<n>  Use <n> threads (default: one per processor)\n"
+"    -m<n>  Decode files using up to <n> KiB of memory at once, instead of\n"
+"           in small pieces (default: 1024; 0 disables)\n");
 
     exit(0);
 }
 
+/* Verifies that an input archive exists (unless it is standard input). */
+static void check_input(const char *path)
+{
+    struct stat st;
+
+    if (strcmp(path, "-") == 0) return;
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "%s: is a directory.\n", path);
+        exit(1);
+    }
+}
+
+/* Verifies that the output archive (if any) is not the same file as the
+   given input file, as writing the output would destroy the input. */
+static void check_output(const char *input)
+{
+    struct stat st_in, st_out;
+
+    if (arg_output != NULL && strcmp(input, "-") != 0 &&
+        stat(arg_output, &st_out) == 0 && stat(input, &st_in) == 0 &&
+        st_out.st_dev == st_in.st_dev && st_out.st_ino == st_in.st_ino)
+    {
+        fprintf(stderr, "%s: output must differ from input.\n", arg_output);
+        exit(1);
+    }
+}
+
 static void parse_args(int argc, char *argv[])
 {
     struct stat st;
+    char **p, *end;
+    unsigned long kib;
     int i = 2;  /* index of first file argument */
 
     if (argc < 3) usage();
 
-    if (argv[i][0] == '-')
+    if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][1] != '-')
     {
         /* Parse options */
         while (*++argv[i] != '\0')
@@ -289,40 +805,121 @@ static void parse_args(int argc, char *argv[])
             case '1': arg_com = COM_DEFLATE; break;
             case '2': arg_com = COM_LZMA;    break;
             case 'u': lzma_omit_uncompressed_size = 1; break;
+            case 'j':
+                num_threads = (int)strtol(argv[i] + 1, &argv[i], 10);
+                if (num_threads <= 0) usage();
+                --argv[i];
+                break;
+            case 'm':
+                if (argv[i][1] < '0' || argv[i][1] > '9') usage();
+                kib = strtoul(argv[i] + 1, &end, 10);
+                if (kib > (unsigned long)((size_t)-1 >> 10)) usage();
+                decode_buffer_limit = (size_t)kib << 10;
+                argv[i] = end - 1;
+                break;
             default:  usage();
             }
         }
         i++;
     }
 
+    /* Parse long options */
+    for ( ; i < argc && strncmp(argv[i], "--", 2) == 0; ++i)
+    {
+        if (strcmp(argv[i], "--lzma-size=add") == 0)
+            arg_lzma_size = 1;
+        else
+        if (strcmp(argv[i], "--lzma-size=remove") == 0)
+            arg_lzma_size = 0;
+        else
+        if (strcmp(argv[i], "--mmap") == 0)
+            output_flags |= OUTPUT_MAPPED;
+        else
+        if (strcmp(argv[i], "--drop-cache") == 0)
+            output_flags |= OUTPUT_DROP_CACHE;
+        else
+        if (strcmp(argv[i], "--checksums") == 0)
+            add_checksums = 1;
+        else
+        if (strcmp(argv[i], "--index") == 0)
+            arg_index = 1;
+        else
+        if (strcmp(argv[i], "--sorted-index") == 0)
+            sort_index = 1;
+        else
+        if (strncmp(argv[i], "--access-span=", 14) == 0)
+        {
+            access_span = strtoul(argv[i] + 14, &end, 10);
+            if (*end != '\0' || access_span == 0 || access_span >= 4096)
+                usage();
+            access_span <<= 20;
+        }
+        else
+        if (strncmp(argv[i], "--align=", 8) == 0)
+        {
+            store_alignment = strtoul(argv[i] + 8, &end, 10);
+            if (*end != '\0' || store_alignment < 16 ||
+                (store_alignment & (store_alignment - 1)) != 0) usage();
+        }
+        else
+        if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            arg_dir = argv[++i];
+            while (*arg_dir != '\0' && arg_dir[strlen(arg_dir) - 1] == '/')
+                arg_dir[strlen(arg_dir) - 1] = '\0';
+        }
+        else
+        if ((strcmp(argv[i], "--from-tar") == 0 ||
+             strcmp(argv[i], "--to-tar") == 0) && i + 1 < argc)
+            arg_tar = argv[++i];
+        else
+            usage();
+    }
+
     if (strcmp(argv[1], "list") == 0 || strcmp(argv[1], "t") == 0)
     {
-        if (argc != i + 1) usage();
+        if (argc < i + 1) usage();
         arg_mode    = LIST;
         arg_archive = argv[i];
+        arg_files_begin = &argv[i];
+        arg_files_end   = &argv[argc];
     }
     else
     if (strcmp(argv[1], "extract") == 0 || strcmp(argv[1], "x") == 0)
     {
-        if (argc != i + 1) usage();
+        if (argc < i + 1) usage();
+        if (arg_tar != NULL && argc != i + 1) usage();
         arg_mode    = EXTRACT;
         arg_archive = argv[i];
+        arg_output  = arg_tar;
+        arg_files_begin = &argv[i];
+        arg_files_end   = &argv[argc];
     }
     else
-    if (strcmp(argv[1], "create") == 0 || strcmp(argv[1], "c") == 0)
+    if (strcmp(argv[1], "cat") == 0)
     {
-        char **p;
-
         if (argc < i + 2) usage();
+        arg_mode    = CAT;
+        arg_archive = argv[i];
+        arg_files_begin = &argv[i];
+        arg_files_end   = &argv[argc - 1];
+        arg_path    = argv[argc - 1];
+    }
+    else
+    if (strcmp(argv[1], "create") == 0 || strcmp(argv[1], "c") == 0)
+    {
+        if (argc < i + (arg_tar != NULL ? 1 : 2)) usage();
+        if (arg_tar != NULL && argc != i + 1) usage();
 
         arg_mode    = CREATE;
-        arg_com     = COM_LZMA;
 
         arg_archive = argv[i++];
         arg_files_begin = &argv[i];
         arg_files_end   = &argv[argc];
 
-        /* Ensure that arguments are indeed directories */
+        /* Ensure that arguments are directories or containers */
+        arg_containers = malloc(arg_files_end - arg_files_begin + 1);
+        assert(arg_containers != NULL);
         for (p = arg_files_begin; p != arg_files_end; ++p)
         {
             if (stat(*p, &st) != 0)
@@ -330,62 +927,297 @@ static void parse_args(int argc, char *argv[])
                 perror(*p);
                 exit(1);
             }
-            if (!S_ISDIR(st.st_mode))
+            arg_containers[p - arg_files_begin] =
+                S_ISREG(st.st_mode) && is_container(*p);
+            if (!S_ISDIR(st.st_mode) && !arg_containers[p - arg_files_begin])
             {
-                fprintf(stderr, "%s: not a directory.\n", *p);
+                fprintf(stderr, "%s: not a directory or container.\n", *p);
                 exit(1);
             }
         }
 
     }
     else
+    if (strcmp(argv[1], "recompress") == 0)
+    {
+        if (argc != i + 2) usage();
+        arg_mode    = RECOMPRESS;
+        arg_archive = argv[i];
+        arg_output  = argv[i + 1];
+    }
+    else
+    if (strcmp(argv[1], "repack") == 0)
+    {
+        if (argc < i + 3) usage();
+        arg_mode    = REPACK;
+        arg_archive = argv[i];
+        arg_output  = argv[i + 1];
+        arg_files_begin = &argv[i + 2];
+        arg_files_end   = &argv[argc];
+    }
+    else
+    if (strcmp(argv[1], "merge") == 0)
+    {
+        if (argc < i + 2) usage();
+        arg_mode    = MERGE;
+        arg_output  = argv[i];
+        arg_files_begin = &argv[i + 1];
+        arg_files_end   = &argv[argc];
+        arg_archive = arg_files_begin[0];
+    }
+    else
+    if (strcmp(argv[1], "diff-pack") == 0 || strcmp(argv[1], "apply") == 0)
+    {
+        if (argc != i + 3) usage();
+        arg_mode     = strcmp(argv[1], "apply") == 0 ? APPLY : DIFF;
+        arg_archive  = argv[i];
+        arg_archive2 = argv[i + 1];
+        arg_output   = argv[i + 2];
+    }
+    else
+    if (strcmp(argv[1], "compare") == 0)
+    {
+        if (argc != i + 2) usage();
+        arg_mode     = COMPARE;
+        arg_archive  = argv[i];
+        arg_archive2 = argv[i + 1];
+    }
+    else
+    if (strcmp(argv[1], "index") == 0)
+    {
+        if (argc < i + 1) usage();
+        arg_mode    = INDEX;
+        arg_archive = argv[i];
+        arg_files_begin = &argv[i];
+        arg_files_end   = &argv[argc];
+    }
+    else
+    if (strcmp(argv[1], "verify") == 0)
+    {
+        if (argc != i + 1) usage();
+        arg_mode    = VERIFY;
+        arg_archive = argv[i];
+    }
+    else
+    if (strcmp(argv[1], "export-zip") == 0)
+    {
+        if (argc != i + 2) usage();
+        arg_mode    = EXPORT_ZIP;
+        arg_archive = argv[i];
+        arg_output  = argv[i + 1];
+    }
+    else
+    if (strcmp(argv[1], "convert") == 0)
+    {
+        if (argc != i + 2 || arg_lzma_size < 0) usage();
+        arg_mode    = CONVERT;
+        arg_archive = argv[i];
+        arg_output  = argv[i + 1];
+    }
+    else
     {
         usage();
     }
 
-    /* Verify that archive exists */
-    if (arg_mode == LIST || arg_mode == EXTRACT)
+    /* Verify that archives exist (unless read from standard input) */
+    if (arg_mode == LIST || arg_mode == EXTRACT || arg_mode == CAT ||
+        arg_mode == MERGE || arg_mode == INDEX)
     {
-        if (stat(arg_archive, &st) != 0)
-        {
-            perror(arg_archive);
-            exit(1);
-        }
-        if (!S_ISREG(st.st_mode))
+        for (p = arg_files_begin; p != arg_files_end; ++p) check_input(*p);
+    }
+    else
+    if (arg_mode != CREATE)
+    {
+        check_input(arg_archive);
+    }
+    if (arg_mode == CREATE && arg_tar != NULL)
+    {
+        check_input(arg_tar);
+    }
+    if (arg_archive2 != NULL)
+    {
+        check_input(arg_archive2);
+        check_output(arg_archive2);
+    }
+
+    /* Refuse to overwrite the input archive(s) */
+    if (arg_mode == MERGE)
+    {
+        for (p = arg_files_begin; p != arg_files_end; ++p)
         {
-            fprintf(stderr, "%s: not a regular file.\n", arg_archive);
-            exit(1);
+            check_output(*p);
         }
     }
+    else
+    {
+        check_output(arg_archive);
+    }
 }
 
 int main(int argc, char *argv[])
 {
+    Archive *ar, **archives;
+    Overlay *ov;
+    OverlayEntry found;
+    char **p;
+    size_t k, n;
+    int overlay;
+
     assert(sizeof(Header)     == 16);
     assert(sizeof(IndexEntry) == 24);
 
+    fp_msg = stdout;
     parse_args(argc, argv);
+    overlay = arg_files_end - arg_files_begin > 1;
 
     switch (arg_mode)
     {
     case LIST:
-        open_archive(arg_archive);
-        process_header();
-        list_entries();
-        close_archive();
+        if (overlay)
+        {
+            ov = open_overlay((const char**)arg_files_begin,
+                              (const char**)arg_files_end);
+            list_overlay_entries(ov);
+            close_overlay(ov);
+            break;
+        }
+        ar = open_archive(arg_archive);
+        list_entries(ar);
+        close_archive(ar);
         break;
 
     case EXTRACT:
-        open_archive(arg_archive);
-        process_header();
-        extract_entries();
-        close_archive();
+        if (arg_tar != NULL)
+        {
+            extract_to_tar(arg_archive, arg_tar);
+            break;
+        }
+        if (overlay)
+        {
+            ov = open_overlay((const char**)arg_files_begin,
+                              (const char**)arg_files_end);
+            extract_overlay_entries(ov);
+            close_overlay(ov);
+            break;
+        }
+        ar = open_archive(arg_archive);
+        if (ar->checksums != NULL) map_archive(ar);
+        if (!ar->seekable)
+            extract_entries_sequentially(ar);
+        else
+        if (num_workers() > 1)
+            extract_entries_parallel(ar);
+        else
+            extract_entries(ar);
+        close_archive(ar);
+        break;
+
+    case CAT:
+        if (overlay)
+        {
+            /* Look the file up in each archive rather than combining them */
+            archives = open_archives((const char**)arg_files_begin,
+                                     (const char**)arg_files_end);
+            n = arg_files_end - arg_files_begin;
+            if (!lookup_overlay_entry(archives, n, arg_path, &found))
+            {
+                found.ar    = NULL;
+                found.entry = (size_t)-1;
+            }
+            if (cat_entry(found.ar, found.entry, arg_path) != 0) return 1;
+            for (k = 0; k < n; ++k) close_archive(archives[k]);
+            free(archives);
+            break;
+        }
+        /* A single file is found without building a hash table (or with
+           the archive's lookup index) */
+        ar = open_archive(arg_archive);
+        if (!ar->seekable)
+        {
+            fprintf(stderr, "%s: not a regular file.\n", arg_archive);
+            exit(1);
+        }
+        if (cat_entry(ar, lookup_entry(ar, arg_path), arg_path) != 0)
+            return 1;
+        close_archive(ar);
+        break;
+
+    case INDEX:
+        for (p = arg_files_begin; p != arg_files_end; ++p)
+        {
+            write_lookup_index(*p);
+            write_access_points(*p);
+        }
         break;
 
     case CREATE:
+        if (arg_tar != NULL)
+        {
+            create_archive_from_tar(arg_archive, arg_tar, arg_com);
+            break;
+        }
         create_archive(arg_archive, (const char**)arg_files_begin,
-                                    (const char**)arg_files_end, arg_com);
+                                    (const char**)arg_files_end,
+                                    arg_containers, arg_com);
+        break;
+
+    case RECOMPRESS:
+        recompress_archive(arg_archive, arg_output, arg_com);
+        break;
+
+    case REPACK:
+        repack_archive(arg_archive, arg_output, (const char**)arg_files_begin,
+                                                (const char**)arg_files_end);
+        break;
+
+    case MERGE:
+        merge_archives(arg_output, (const char**)arg_files_begin,
+                                   (const char**)arg_files_end);
+        break;
+
+    case DIFF:
+        diff_archives(arg_archive, arg_archive2, arg_output);
+        break;
+
+    case APPLY:
+        apply_patch(arg_archive, arg_archive2, arg_output);
+        break;
+
+    case COMPARE:
+        if (compare_archives(arg_archive, arg_archive2) > 0) return 1;
+        break;
+
+    case VERIFY:
+        if (verify_archive(arg_archive) > 0) return 1;
         break;
+
+    case EXPORT_ZIP:
+        export_zip(arg_archive, arg_output);
+        break;
+
+    case CONVERT:
+        convert_archive(arg_archive, arg_output, arg_lzma_size);
+        break;
+    }
+
+    /* Write a lookup index and access points for the archive written, if
+       requested */
+    if (arg_index)
+    {
+        if (arg_mode == CREATE)
+            arg_output = arg_archive;
+        else
+        if (arg_mode != RECOMPRESS && arg_mode != REPACK && arg_mode != MERGE &&
+            arg_mode != DIFF && arg_mode != APPLY && arg_mode != CONVERT)
+            arg_output = NULL;
+
+        if (arg_output == NULL || strcmp(arg_output, "-") == 0)
+            fprintf(stderr, "No archive file written; index not created.\n");
+        else
+        {
+            write_lookup_index(arg_output);
+            write_access_points(arg_output);
+        }
     }
 
     return 0;
@@ -0,0 +1,395 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+enum ContainerType { CONTAINER_NONE, CONTAINER_ZIP, CONTAINER_GZIP,
+                     CONTAINER_LZMA };
+
+/* An entry imported from a container */
+struct Import
+{
+    size_t              entry;      /* Index of entry in archive */
+    const char          *path;      /* Path to container file */
+    enum ContainerType  type;       /* Type of container */
+    long                offset;     /* Offset of data in container */
+    size_t              size;       /* Size of data in container */
+    Compression         com;        /* Compression method of data */
+    size_t              uncompressed_size;
+};
+
+static struct Import *imports;
+static size_t imports_size, imports_capacity, imports_next;
+
+static enum ContainerType container_type(const char *path)
+{
+    static const struct { const char *ext; enum ContainerType type; }
+        exts[] = { { ".zip",  CONTAINER_ZIP  },
+                   { ".gz",   CONTAINER_GZIP },
+                   { ".lzma", CONTAINER_LZMA } };
+    size_t n, len = strlen(path);
+    int i;
+
+    for (i = 0; i < (int)(sizeof(exts)/sizeof(*exts)); ++i)
+    {
+        n = strlen(exts[i].ext);
+        if (len > n && compare_strings(path + len - n, exts[i].ext, 1) == 0)
+        {
+            return exts[i].type;
+        }
+    }
+    return CONTAINER_NONE;
+}
+
+int is_container(const char *path)
+{
+    return container_type(path) != CONTAINER_NONE;
+}
+
+static void add_import( const char *path, enum ContainerType type,
+                        const char *name, long offset, size_t size,
+                        Compression com, size_t uncompressed_size )
+{
+    char dir[PATH_LEN];
+    const char *file;
+    struct Import *im;
+
+    /* Split name into directory and file name */
+    file = strrchr(name, '/');
+    if (file == NULL)
+    {
+        dir[0] = '\0';
+        file = name;
+    }
+    else
+    {
+        assert(file - name < PATH_LEN);
+        memcpy(dir, name, file - name);
+        dir[file - name] = '\0';
+        ++file;
+    }
+
+    if (imports_size == imports_capacity)
+    {
+        imports_capacity = imports_capacity > 0 ? 2*imports_capacity : 8;
+        imports = realloc(imports, sizeof(struct Import)*imports_capacity);
+        assert(imports != NULL);
+    }
+    im = &imports[imports_size++];
+    im->entry  = alloc_entry(dir, file, com, uncompressed_size, 0);
+    im->path   = path;
+    im->type   = type;
+    im->offset = offset;
+    im->size   = size;
+    im->com    = com;
+    im->uncompressed_size = uncompressed_size;
+}
+
+/* Stores the name of a single-file container without its directory and
+   extension of length ``ext_len'' in name. */
+static void member_name(char *name, const char *path, size_t ext_len)
+{
+    const char *p = strrchr(path, '/');
+
+    strcpy(name, p != NULL ? p + 1 : path);
+    name[strlen(name) - ext_len] = '\0';
+}
+
+static FILE *open_container(const char *path, long *file_size)
+{
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 ||
+        (*file_size = ftell(fp)) == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+    rewind(fp);
+    return fp;
+}
+
+static void read_at(FILE *fp, long offset, void *buf, size_t size)
+{
+    if (fseek(fp, offset, SEEK_SET) != 0 || fread(buf, 1, size, fp) != size)
+    {
+        perror("Read failed");
+        abort();
+    }
+}
+
+/* Imports the members of a ZIP file, using its central directory. Deflated
+   members are copied as-is; stored members are compressed normally. */
+static void import_zip(const char *path)
+{
+    unsigned char eocd[22 + 65535], cd[46], lh[30];
+    char name[PATH_LEN];
+    long file_size, tail, offset, cd_offset, data;
+    size_t i, n, entries, name_len, extra_len, comment_len;
+    uint16_t flags, method;
+    uint32_t csize, usize;
+    FILE *fp;
+
+    fp = open_container(path, &file_size);
+
+    /* Find end of central directory record */
+    tail = file_size < (long)sizeof(eocd) ? file_size : (long)sizeof(eocd);
+    if (tail < 22)
+    {
+        fprintf(stderr, "%s: not a ZIP file.\n", path);
+        exit(1);
+    }
+    read_at(fp, file_size - tail, eocd, (size_t)tail);
+    for (n = (size_t)tail - 22; n > 0 && get_uint32(eocd + n) != 0x06054b50ul;
+         --n) { }
+    if (get_uint32(eocd + n) != 0x06054b50ul)
+    {
+        fprintf(stderr, "%s: not a ZIP file.\n", path);
+        exit(1);
+    }
+    entries   = get_uint16(eocd + n + 10);
+    cd_offset = (long)get_uint32(eocd + n + 16);
+
+    /* Process central directory */
+    offset = cd_offset;
+    for (i = 0; i < entries; ++i)
+    {
+        read_at(fp, offset, cd, sizeof(cd));
+        if (get_uint32(cd) != 0x02014b50ul)
+        {
+            fprintf(stderr, "%s: corrupt central directory.\n", path);
+            exit(1);
+        }
+        flags       = get_uint16(cd + 8);
+        method      = get_uint16(cd + 10);
+        csize       = get_uint32(cd + 20);
+        usize       = get_uint32(cd + 24);
+        name_len    = get_uint16(cd + 28);
+        extra_len   = get_uint16(cd + 30);
+        comment_len = get_uint16(cd + 32);
+        data        = (long)get_uint32(cd + 42);
+        if (name_len >= sizeof(name)) name_len = sizeof(name) - 1;
+        read_at(fp, offset + 46, name, name_len);
+        name[name_len] = '\0';
+        offset += 46 + get_uint16(cd + 28) + extra_len + comment_len;
+
+        if (name_len > 0 && name[name_len - 1] == '/') continue;  /* dir */
+
+        if (!is_safe_path(name))
+        {
+            fprintf(stderr, "%s: %s: unsafe path; skipped.\n", path, name);
+            continue;
+        }
+        if (flags & 1)
+        {
+            fprintf(stderr, "%s: %s: encrypted; skipped.\n", path, name);
+            continue;
+        }
+        if (csize == 0xfffffffful || usize == 0xfffffffful)
+        {
+            fprintf(stderr, "%s: %s: ZIP64 not supported; skipped.\n",
+                            path, name);
+            continue;
+        }
+        if (method != 0 && method != 8)
+        {
+            fprintf(stderr, "%s: %s: compression method %d not supported; "
+                            "skipped.\n", path, name, method);
+            continue;
+        }
+
+        /* Locate data after local file header */
+        read_at(fp, data, lh, sizeof(lh));
+        if (get_uint32(lh) != 0x04034b50ul)
+        {
+            fprintf(stderr, "%s: %s: corrupt local header; skipped.\n",
+                            path, name);
+            continue;
+        }
+        data += 30 + get_uint16(lh + 26) + get_uint16(lh + 28);
+
+        add_import( path, CONTAINER_ZIP, name, data, csize,
+                    method == 8 ? COM_DEFLATE : COM_NONE, usize );
+    }
+
+    fclose(fp);
+}
+
+/* Imports a gzip file as a single deflated entry (without the .gz suffix).
+   Only the first member of a multi-member gzip file is imported; its
+   deflate stream is decoded once to find where it ends. */
+static void import_gzip(const char *path)
+{
+    unsigned char header[10], buf[2];
+    char name[PATH_LEN];
+    long file_size, data;
+    size_t stored_size, size;
+    int c, flags;
+    FILE *fp;
+
+    fp = open_container(path, &file_size);
+    read_at(fp, 0, header, sizeof(header));
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8)
+    {
+        fprintf(stderr, "%s: not a gzip file.\n", path);
+        exit(1);
+    }
+    flags = header[3];
+    if (flags & 4)  /* FEXTRA */
+    {
+        read_at(fp, 10, buf, 2);
+        fseek(fp, get_uint16(buf), SEEK_CUR);
+    }
+    if (flags & 8)  /* FNAME */
+    {
+        while ((c = getc(fp)) != EOF && c != 0) { }
+    }
+    if (flags & 16) /* FCOMMENT */
+    {
+        while ((c = getc(fp)) != EOF && c != 0) { }
+    }
+    if (flags & 2)  /* FHCRC */
+    {
+        fseek(fp, 2, SEEK_CUR);
+    }
+    data = ftell(fp);
+    if (feof(fp) || data + 8 > file_size)
+    {
+        fprintf(stderr, "%s: truncated gzip file.\n", path);
+        exit(1);
+    }
+    stored_size = measure_deflated(fp, (size_t)(file_size - 8 - data), &size);
+    if (data + (long)stored_size + 8 < file_size)
+    {
+        fprintf(stderr, "%s: only the first member is imported.\n", path);
+    }
+    if ((uint32_t)size != size)
+    {
+        fprintf(stderr, "%s: file too big; skipped.\n", path);
+        fclose(fp);
+        return;
+    }
+
+    member_name(name, path, 3);
+    add_import( path, CONTAINER_GZIP, name, data, stored_size,
+                COM_DEFLATE, size );
+
+    fclose(fp);
+}
+
+/* Imports a .lzma file as a single LZMA compressed entry (without the .lzma
+   suffix). If the file does not record its uncompressed size, the data is
+   decoded once to determine it; the compressed data is still copied. */
+static void import_lzma(const char *path)
+{
+    unsigned char header[13];
+    char name[PATH_LEN];
+    long file_size;
+    size_t size;
+    FILE *fp;
+    int i;
+
+    fp = open_container(path, &file_size);
+    if (file_size < 13)
+    {
+        fprintf(stderr, "%s: not an LZMA file.\n", path);
+        exit(1);
+    }
+    read_at(fp, 0, header, sizeof(header));
+    for (i = 5; i < 13 && header[i] == 0xff; ++i) { }
+    if (i == 13)
+    {
+        rewind(fp);
+        size = copy_lzmad_alone(NULL, fp, (size_t)file_size);
+    }
+    else
+    {
+        if (get_uint32(header + 9) != 0)
+        {
+            fprintf(stderr, "%s: file too big; skipped.\n", path);
+            fclose(fp);
+            return;
+        }
+        size = get_uint32(header + 5);
+    }
+
+    member_name(name, path, 5);
+    add_import( path, CONTAINER_LZMA, name, 13, (size_t)file_size - 13,
+                COM_LZMA, size );
+
+    fclose(fp);
+}
+
+void import_container(const char *path)
+{
+    switch (container_type(path))
+    {
+    case CONTAINER_ZIP:  import_zip(path);   break;
+    case CONTAINER_GZIP: import_gzip(path);  break;
+    case CONTAINER_LZMA: import_lzma(path);  break;
+    default: assert(0);
+    }
+}
+
+int write_imported_entry(size_t i, Compression max_com)
+{
+    struct Import *im;
+    unsigned char header[13];
+    FILE *fp;
+
+    if (imports_next == imports_size || imports[imports_next].entry != i)
+    {
+        return 0;
+    }
+    im = &imports[imports_next++];
+
+    fp = fopen(im->path, "rb");
+    if (fp == NULL || fseek(fp, im->offset, SEEK_SET) != 0)
+    {
+        perror(im->path);
+        abort();
+    }
+
+    switch (im->com)
+    {
+    case COM_NONE:
+        write_entry(i, fp, max_com);
+        break;
+
+    case COM_DEFLATE:
+        write_entry_raw(i, fp, COM_DEFLATE, im->size);
+        break;
+
+    case COM_LZMA:
+        /* Rewrite header: LZMA properties, followed by the uncompressed
+           size (unless omitted) */
+        fseek(fp, 0, SEEK_SET);
+        if (fread(header, 1, 5, fp) != 5)
+        {
+            perror("Read failed");
+            abort();
+        }
+        memset(header + 5, 0, 8);
+        put_uint32(header + 5, (uint32_t)im->uncompressed_size);
+        fseek(fp, im->offset, SEEK_SET);
+        begin_entry(i, COM_LZMA);
+        write_entry_bytes(header, lzma_omit_uncompressed_size ? 5 : 13);
+        copy_entry_bytes(fp, im->size);
+        end_entry(i);
+        break;
+    }
+
+    fclose(fp);
+
+    if (imports_next == imports_size)
+    {
+        free(imports);
+        imports = NULL;
+        imports_size = imports_capacity = imports_next = 0;
+    }
+    return 1;
+}
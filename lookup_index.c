@@ -0,0 +1,309 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+/* Lookup index file layout (all integers little-endian):
+
+   off type    descr
+     0 uint32  Magic number 0x33584848 ("HHX3")
+     4         Stamp of the archive file (see archive_stamp())
+    28 uint32  Number of entries in the archive (I)
+    32 uint32  Number of hash table slots (N, a power of two)
+    36         Reserved (0), 12 bytes
+    48         N slots of 8 bytes:
+                 uint32  hash_string(path, 1) of the entry's path
+                 uint32  entry ordinal + 1 (0 if the slot is empty)
+
+   Slots are probed linearly, starting at the hash modulo N. If the archive
+   contains a path more than once (ignoring case), the slot refers to the
+   last entry, as in overlays. */
+#define LOOKUP_MAGIC        0x33584848ul
+#define LOOKUP_HEADER_SIZE  48
+
+void sidecar_path( const char *archive_path, const char *ext,
+                   char path[PATH_LEN] )
+{
+    size_t len = strlen(archive_path);
+
+    if (len >= 4 && compare_strings(archive_path + len - 4, ".hha", 1) == 0)
+        len -= 4;
+    assert(len + strlen(ext) + 1 <= PATH_LEN);
+    memcpy(path, archive_path, len);
+    strcpy(path + len, ext);
+}
+
+int archive_stamp(const Archive *ar, unsigned char stamp[SIDECAR_STAMP_SIZE])
+{
+    struct stat st;
+    uint32_t crc;
+
+    if (!ar->seekable || strcmp(ar->path, "-") == 0 ||
+        fstat(fileno(ar->fp), &st) != 0) return 0;
+
+    crc = crc32c(0, ar->strings, ar->strings_size);
+    crc = crc32c(crc, ar->entries, sizeof(IndexEntry)*ar->entries_size);
+
+    /* Size, the low and high 32 bits of the modification time and the
+       inode number, and the checksum of the string table and index */
+    put_uint32(stamp,      (uint32_t)ar->file_size);
+    put_uint32(stamp + 4,  (uint32_t)st.st_mtime);
+    put_uint32(stamp + 8,  sizeof(st.st_mtime) > 4 ?
+                           (uint32_t)((st.st_mtime >> 16) >> 16) : 0);
+    put_uint32(stamp + 12, (uint32_t)st.st_ino);
+    put_uint32(stamp + 16, sizeof(st.st_ino) > 4 ?
+                           (uint32_t)((st.st_ino >> 16) >> 16) : 0);
+    put_uint32(stamp + 20, crc);
+    return 1;
+}
+
+void write_sidecar(const char *path, const void *data, size_t size)
+{
+    char tmp_path[PATH_LEN + 4];
+    FILE *fp;
+
+    /* Write to a temporary file first, so processes that have the old
+       file mapped are not affected */
+    sprintf(tmp_path, "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        perror(tmp_path);
+        exit(1);
+    }
+    if (fwrite(data, 1, size, fp) != size || fclose(fp) != 0)
+    {
+        perror("Could not write index");
+        abort();
+    }
+#ifdef WIN32
+    remove(path);
+#endif
+    if (rename(tmp_path, path) != 0)
+    {
+        perror(path);
+        exit(1);
+    }
+}
+
+const unsigned char *map_sidecar(const char *path, size_t *size)
+{
+    struct stat st;
+    const unsigned char *data;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size <= 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+
+#ifndef WIN32
+    data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (data == MAP_FAILED) data = NULL;
+#else
+    data = malloc(*size);
+    if (data != NULL && fread((void*)data, 1, *size, fp) != *size)
+    {
+        free((void*)data);
+        data = NULL;
+    }
+#endif
+    fclose(fp);
+    return data;
+}
+
+void unmap_sidecar(const unsigned char *data, size_t size)
+{
+#ifndef WIN32
+    munmap((void*)data, size);
+#else
+    (void)size;
+    free((void*)data);
+#endif
+}
+
+void write_lookup_index(const char *archive_path)
+{
+    Archive *ar;
+    char index_path[PATH_LEN];
+    unsigned char *data, *slot, stamp[SIDECAR_STAMP_SIZE];
+    size_t i, n, size, capacity;
+    uint32_t hash;
+
+    ar = open_archive(archive_path);
+    load_paths(ar);
+    if (!archive_stamp(ar, stamp))
+    {
+        fprintf(stderr, "%s: not a regular file.\n", archive_path);
+        exit(1);
+    }
+
+    /* Keep the load factor at most 1/2 */
+    for (capacity = 16; capacity < 2*ar->entries_size; capacity *= 2) { }
+    size = LOOKUP_HEADER_SIZE + 8*capacity;
+    data = calloc(size, 1);
+    assert(data != NULL);
+
+    put_uint32(data, LOOKUP_MAGIC);
+    memcpy(data + 4, stamp, SIDECAR_STAMP_SIZE);
+    put_uint32(data + 28, (uint32_t)ar->entries_size);
+    put_uint32(data + 32, (uint32_t)capacity);
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        hash = ar->hashes[i];
+        for (n = hash & (capacity - 1); ; n = (n + 1) & (capacity - 1))
+        {
+            slot = data + LOOKUP_HEADER_SIZE + 8*n;
+            if (get_uint32(slot + 4) == 0) break;
+            if (get_uint32(slot) != hash) continue;
+            if (compare_strings(entry_full_path(ar, get_uint32(slot + 4) - 1),
+                                entry_full_path(ar, i), 1) == 0) break;
+        }
+        put_uint32(slot,     hash);
+        put_uint32(slot + 4, (uint32_t)(i + 1));
+    }
+
+    sidecar_path(archive_path, ".hhx", index_path);
+    write_sidecar(index_path, data, size);
+    free(data);
+    close_archive(ar);
+}
+
+void load_lookup_index(Archive *ar)
+{
+    char index_path[PATH_LEN];
+    unsigned char stamp[SIDECAR_STAMP_SIZE];
+    uint32_t capacity;
+
+    if (!ar->seekable || strcmp(ar->path, "-") == 0) return;
+    sidecar_path(ar->path, ".hhx", index_path);
+    ar->lookup = map_sidecar(index_path, &ar->lookup_size);
+    if (ar->lookup == NULL) return;
+
+    /* Use the index only if it matches the archive */
+    if (!archive_stamp(ar, stamp) || ar->lookup_size < LOOKUP_HEADER_SIZE ||
+        get_uint32(ar->lookup) != LOOKUP_MAGIC ||
+        memcmp(ar->lookup + 4, stamp, SIDECAR_STAMP_SIZE) != 0 ||
+        get_uint32(ar->lookup + 28) != ar->entries_size ||
+        (capacity = get_uint32(ar->lookup + 32)) == 0 ||
+        (capacity & (capacity - 1)) != 0 ||
+        ar->lookup_size != LOOKUP_HEADER_SIZE + 8*(size_t)capacity)
+    {
+        unload_lookup_index(ar);
+    }
+}
+
+void unload_lookup_index(Archive *ar)
+{
+    if (ar->lookup == NULL) return;
+    unmap_sidecar(ar->lookup, ar->lookup_size);
+    ar->lookup      = NULL;
+    ar->lookup_size = 0;
+}
+
+/* Returns the first entry of a sorted archive whose path compares greater
+   than (if ``after'' is nonzero) or not less than ``path'', considering
+   only the first ``len'' characters of each path. */
+static size_t search_sorted( const Archive *ar, const char *path, size_t len,
+                             int after )
+{
+    size_t lo = 0, hi = ar->entries_size, mid;
+    int res;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        res = compare_prefix(entry_full_path(ar, mid), path, len, 1);
+        if (res < 0 || (after && res == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int prefix_range( Archive *ar, const char *prefix,
+                  size_t *begin, size_t *end )
+{
+    load_paths(ar);
+    if (!ar->sorted) return 0;
+    *begin = search_sorted(ar, prefix, strlen(prefix), 0);
+    *end   = search_sorted(ar, prefix, strlen(prefix), 1);
+    return 1;
+}
+
+/* Returns whether entry i has the given path (ignoring case), comparing its
+   names in the string table so the path pool is not needed. */
+static int has_path(const Archive *ar, size_t i, const char *path)
+{
+    const IndexEntry *e = &ar->entries[i];
+    const char *dir_name;
+    size_t len;
+
+    if (e->dir_name >= ar->strings_size || e->file_name >= ar->strings_size)
+        return 0;
+    dir_name = strat(ar, e->dir_name);
+    len = strlen(dir_name);
+    if (len > 0)
+    {
+        if (compare_prefix(path, dir_name, len, 1) != 0 || path[len] != '/')
+            return 0;
+        path += len + 1;
+    }
+    return compare_strings(path, strat(ar, e->file_name), 1) == 0;
+}
+
+size_t lookup_entry(Archive *ar, const char *path)
+{
+    const unsigned char *slot;
+    size_t i, n, k, capacity;
+    uint32_t hash;
+
+    if (ar->lookup == NULL) load_paths(ar);
+    if (ar->lookup == NULL && ar->sorted)
+    {
+        /* Entries with the same path are adjacent; take the last one */
+        i = search_sorted(ar, path, PATH_LEN, 1);
+        if (i == 0) return (size_t)-1;
+        return compare_strings(entry_full_path(ar, i - 1), path, 1) == 0 ?
+               i - 1 : (size_t)-1;
+    }
+
+    hash = hash_string(path, 1);
+    if (ar->lookup == NULL)
+    {
+        /* Without an index, scan the hashes backwards to find the last
+           entry; paths are compared only when the hashes match. */
+        for (i = ar->entries_size; i-- > 0; )
+        {
+            if (ar->hashes[i] == hash &&
+                compare_strings(entry_full_path(ar, i), path, 1) == 0)
+                return i;
+        }
+        return (size_t)-1;
+    }
+
+    capacity = get_uint32(ar->lookup + 32);
+    n = hash & (capacity - 1);
+    for (k = 0; k < capacity; ++k, n = (n + 1) & (capacity - 1))
+    {
+        slot = ar->lookup + LOOKUP_HEADER_SIZE + 8*n;
+        i = get_uint32(slot + 4);
+        if (i == 0 || i > ar->entries_size) break;
+        if (get_uint32(slot) == hash && has_path(ar, i - 1, path))
+            return i - 1;
+    }
+    return (size_t)-1;
+}
@@ -0,0 +1,104 @@
+/* Benchmark of LZMA decoding into memory.
+
+   Decodes every LZMA compressed entry of an archive repeatedly, once with
+   the streaming decoder writing to a FILE (LzmaDec_DecodeToBuf, which
+   copies from the dictionary into a buffer that is then copied by fwrite())
+   and once with copy_lzmad_to_buffer(), which decodes straight into the
+   destination buffer. Usage: lzma_bench [-u] <archive> [<iterations>] */
+
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+static double run(Archive *ar, FILE *fp_null, unsigned char *buf,
+                  int iterations, int to_buffer, size_t *total)
+{
+    const IndexEntry *e;
+    clock_t start;
+    size_t i;
+    int n;
+
+    *total = 0;
+    start = clock();
+    for (n = 0; n < iterations; ++n)
+    {
+        for (i = 0; i < ar->entries_size; ++i)
+        {
+            e = &ar->entries[i];
+            if (e->compression != COM_LZMA) continue;
+            seek_entry(ar, i);
+            if (to_buffer)
+                *total += copy_lzmad_to_buffer(buf, e->size, ar->fp,
+                                               e->stored_size);
+            else
+                *total += copy_lzmad(fp_null, ar->fp, e->stored_size);
+        }
+    }
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    Archive *ar;
+    FILE *fp_null;
+    unsigned char *buf;
+    size_t i, max_size, total;
+    double t_file, t_buffer;
+    int iterations;
+
+    if (argc > 1 && strcmp(argv[1], "-u") == 0)
+    {
+        lzma_omit_uncompressed_size = 1;
+        --argc;
+        ++argv;
+    }
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: lzma_bench [-u] <archive> [<iterations>]\n");
+        return 1;
+    }
+    iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    ar = open_archive(argv[1]);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", argv[1]);
+        return 1;
+    }
+    fp_null = fopen("/dev/null", "wb");
+    if (fp_null == NULL)
+    {
+        perror("/dev/null");
+        return 1;
+    }
+    max_size = 1;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (ar->entries[i].size > max_size) max_size = ar->entries[i].size;
+    }
+    buf = malloc(max_size);
+    if (buf == NULL)
+    {
+        perror("Could not allocate memory");
+        return 1;
+    }
+
+    t_file   = run(ar, fp_null, buf, iterations, 0, &total);
+    t_buffer = run(ar, fp_null, buf, iterations, 1, &total);
+
+    printf("Decoded %.1f MB of LZMA data\n", total/1e6);
+    printf("  DecodeToBuf + fwrite(): %8.3f s (%7.1f MB/s)\n",
+           t_file, t_file > 0 ? total/1e6/t_file : 0.0);
+    printf("  DecodeToDic in place:   %8.3f s (%7.1f MB/s)\n",
+           t_buffer, t_buffer > 0 ? total/1e6/t_buffer : 0.0);
+    printf("  Copies avoided:         %8.1f MB\n", 2*total/1e6);
+
+    free(buf);
+    fclose(fp_null);
+    close_archive(ar);
+    return 0;
+}
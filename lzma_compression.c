@@ -85,28 +85,26 @@ static void lzma_free(void *p, void *addr)
 static ISzAlloc szalloc = { lzma_alloc, lzma_free };
 
 
-size_t copy_lzmad(FILE *dst, FILE *src, size_t size_in)
+/* Reads the LZMA properties, followed by the uncompressed size if
+   ``has_size'' is nonzero, from src. Stores the uncompressed size (or the
+   largest possible value, if unknown) in *max_out and returns the number
+   of bytes of compressed data remaining. */
+static size_t read_lzma_header( FILE *src, size_t size_in, int has_size,
+                                unsigned char props[LZMA_PROPS_SIZE],
+                                size_t *max_out )
 {
-    unsigned char buf_in[4096], buf_out[4096];
-    size_t chunk, pos_in, avail_in, avail_out, size_out, max_out;
-    unsigned char lzma_props[LZMA_PROPS_SIZE], uncompressed_size[8];
-    CLzmaDec ld;
-    ELzmaFinishMode finish_mode;
-    ELzmaStatus status;
-    int res;
+    unsigned char uncompressed_size[8];
 
-    /* Read LZMA properties */
     if (size_in < LZMA_PROPS_SIZE ||
-        fread(lzma_props, 1, LZMA_PROPS_SIZE, src) != LZMA_PROPS_SIZE)
+        fread(props, 1, LZMA_PROPS_SIZE, src) != LZMA_PROPS_SIZE)
     {
         perror("Could not read LZMA properties");
         abort();
     }
     size_in -= LZMA_PROPS_SIZE;
-    size_out = 0;
-    if (lzma_omit_uncompressed_size)
+    if (!has_size)
     {
-        max_out = ~0;
+        *max_out = ~0;
     }
     else
     {
@@ -116,8 +114,25 @@ size_t copy_lzmad(FILE *dst, FILE *src, size_t size_in)
             abort();
         }
         size_in -= 8;
-        max_out = decode_int64(uncompressed_size);
+        *max_out = decode_int64(uncompressed_size);
     }
+    return size_in;
+}
+
+/* Decodes LZMA data, which is preceded by the uncompressed size if
+   ``has_size'' is nonzero. */
+static size_t decode_lzma(FILE *dst, FILE *src, size_t size_in, int has_size)
+{
+    unsigned char buf_in[4096], buf_out[4096];
+    size_t chunk, pos_in, avail_in, avail_out, size_out, max_out;
+    unsigned char lzma_props[LZMA_PROPS_SIZE];
+    CLzmaDec ld;
+    ELzmaFinishMode finish_mode;
+    ELzmaStatus status;
+    int res;
+
+    size_in = read_lzma_header(src, size_in, has_size, lzma_props, &max_out);
+    size_out = 0;
 
     /* Allocate decompressor */
     LzmaDec_Construct(&ld);
@@ -159,7 +174,7 @@ size_t copy_lzmad(FILE *dst, FILE *src, size_t size_in)
             pos_in += avail_in;
 
             /* Write output */
-            if (fwrite(buf_out, 1, avail_out, dst) != avail_out)
+            if (dst != NULL && fwrite(buf_out, 1, avail_out, dst) != avail_out)
             {
                 perror("Write failed");
                 abort();
@@ -179,10 +194,214 @@ size_t copy_lzmad(FILE *dst, FILE *src, size_t size_in)
 
 end:
     LzmaDec_Free(&ld, &szalloc);
+    skip_data(src, size_in);
+
+    return size_out;
+}
+
+size_t copy_lzmad(FILE *dst, FILE *src, size_t size_in)
+{
+    return decode_lzma(dst, src, size_in, !lzma_omit_uncompressed_size);
+}
+
+size_t copy_lzmad_alone(FILE *dst, FILE *src, size_t size_in)
+{
+    return decode_lzma(dst, src, size_in, 1);
+}
+
+size_t copy_lzmad_to_buffer(void *dst, size_t dst_size, FILE *src,
+                            size_t size_in)
+{
+    unsigned char buf_in[4096];
+    unsigned char lzma_props[LZMA_PROPS_SIZE];
+    size_t chunk, pos_in, avail_in, max_out, limit;
+    CLzmaDec ld;
+    ELzmaStatus status;
+    int res;
+
+    size_in = read_lzma_header( src, size_in, !lzma_omit_uncompressed_size,
+                                lzma_props, &max_out );
+    limit = dst_size < max_out ? dst_size : max_out;
+
+    /* Allocate probabilities only; the output buffer is the dictionary. */
+    LzmaDec_Construct(&ld);
+    res = LzmaDec_AllocateProbs(&ld, lzma_props, LZMA_PROPS_SIZE, &szalloc);
+    assert(res == SZ_OK);
+    ld.dic        = dst;
+    ld.dicBufSize = dst_size;
+    LzmaDec_Init(&ld);
+
+    chunk = pos_in = 0;
+    status = LZMA_STATUS_NOT_SPECIFIED;
+    while (ld.dicPos < limit && status != LZMA_STATUS_FINISHED_WITH_MARK)
+    {
+        if (pos_in == chunk)
+        {
+            /* Read more input data */
+            if (size_in == 0)
+            {
+                fprintf(stderr, "WARNING: premature end of LZMA input data\n");
+                break;
+            }
+            pos_in = 0;
+            chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+            if (fread(buf_in, 1, chunk, src) != chunk)
+            {
+                perror("Read failed");
+                abort();
+            }
+            size_in -= chunk;
+        }
+
+        avail_in = chunk - pos_in;
+        if (LzmaDec_DecodeToDic( &ld, limit, buf_in + pos_in, &avail_in,
+                limit == max_out ? LZMA_FINISH_END : LZMA_FINISH_ANY,
+                &status ) != SZ_OK)
+        {
+            fprintf(stderr, "WARNING: LZMA decompression failed!\n");
+            break;
+        }
+        pos_in += avail_in;
+    }
+
+    LzmaDec_FreeProbs(&ld, &szalloc);
+    skip_data(src, size_in);
+
+    return ld.dicPos;
+}
+
+size_t copy_lzmad_range( void *dst, size_t dst_size, size_t skip,
+                         FILE *src, size_t size_in )
+{
+    unsigned char buf_in[4096], scratch[16384], *out;
+    unsigned char lzma_props[LZMA_PROPS_SIZE];
+    size_t chunk, pos_in, avail_in, avail_out, pos_out, end, max_out;
+    CLzmaDec ld;
+    ELzmaStatus status;
+    int res;
+
+    size_in = read_lzma_header( src, size_in, !lzma_omit_uncompressed_size,
+                                lzma_props, &max_out );
+    if (skip >= max_out) return 0;
+    end = dst_size < max_out - skip ? skip + dst_size : max_out;
+
+    /* Allocate decompressor */
+    LzmaDec_Construct(&ld);
+    res = LzmaDec_Allocate(&ld, lzma_props, LZMA_PROPS_SIZE, &szalloc);
+    assert(res == SZ_OK);
+    LzmaDec_Init(&ld);
+
+    chunk = pos_in = pos_out = 0;
+    status = LZMA_STATUS_NOT_SPECIFIED;
+    while (pos_out < end && status != LZMA_STATUS_FINISHED_WITH_MARK)
+    {
+        if (pos_in == chunk)
+        {
+            /* Read more input data */
+            if (size_in == 0)
+            {
+                fprintf(stderr, "WARNING: premature end of LZMA input data\n");
+                break;
+            }
+            pos_in = 0;
+            chunk = size_in > sizeof(buf_in) ? sizeof(buf_in) : size_in;
+            if (fread(buf_in, 1, chunk, src) != chunk)
+            {
+                perror("Read failed");
+                abort();
+            }
+            size_in -= chunk;
+        }
+
+        /* Decode into scratch space until ``skip'' bytes are discarded */
+        if (pos_out < skip)
+        {
+            out       = scratch;
+            avail_out = skip - pos_out < sizeof(scratch) ?
+                        skip - pos_out : sizeof(scratch);
+        }
+        else
+        {
+            out       = (unsigned char*)dst + (pos_out - skip);
+            avail_out = end - pos_out;
+        }
+        avail_in = chunk - pos_in;
+        if (LzmaDec_DecodeToBuf( &ld, out, &avail_out,
+                buf_in + pos_in, &avail_in,
+                pos_out + avail_out == max_out ? LZMA_FINISH_END
+                                               : LZMA_FINISH_ANY,
+                &status ) != SZ_OK)
+        {
+            fprintf(stderr, "WARNING: LZMA decompression failed!\n");
+            break;
+        }
+        pos_in  += avail_in;
+        pos_out += avail_out;
+    }
+
+    LzmaDec_Free(&ld, &szalloc);
+
+    return pos_out > skip ? pos_out - skip : 0;
+}
+
+size_t decode_lzma_buffer( void *dst, size_t dst_size,
+                           const void *src, size_t src_size )
+{
+    const unsigned char *data = src;
+    size_t header_size;
+    SizeT size_in, size_out;
+    ELzmaStatus status;
+
+    header_size = LZMA_PROPS_SIZE + (lzma_omit_uncompressed_size ? 0 : 8);
+    if (src_size < header_size)
+    {
+        fprintf(stderr, "WARNING: LZMA header truncated\n");
+        return 0;
+    }
 
+    /* Decode directly into the output buffer, which serves as the
+       decoder's dictionary. */
+    size_in  = src_size - header_size;
+    size_out = dst_size;
+    if (LzmaDecode( dst, &size_out, data + header_size, &size_in,
+                    data, LZMA_PROPS_SIZE, LZMA_FINISH_END, &status,
+                    &szalloc ) != SZ_OK)
+    {
+        fprintf(stderr, "WARNING: LZMA decompression failed!\n");
+    }
     return size_out;
 }
 
+int check_lzma_buffer( const void *src, size_t src_size, size_t size,
+                       int has_size )
+{
+    const unsigned char *data = src;
+    unsigned char *dst;
+    size_t header_size;
+    SizeT size_in, size_out;
+    ELzmaStatus status;
+    int res;
+
+    header_size = LZMA_PROPS_SIZE + (has_size ? 8 : 0);
+    if (src_size < header_size) return 0;
+    dst = malloc(size + 1);
+    if (dst == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    size_in  = src_size - header_size;
+    size_out = size;
+    res = LzmaDecode( dst, &size_out, data + header_size, &size_in,
+                      data, LZMA_PROPS_SIZE, LZMA_FINISH_END, &status,
+                      &szalloc );
+    free(dst);
+    if (res != SZ_OK || size_out != size ||
+        (status != LZMA_STATUS_FINISHED_WITH_MARK &&
+         status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK)) return 0;
+    return size_in == src_size - header_size ? 2 : 1;
+}
+
 size_t copy_lzmac(FILE *dst, FILE *src, size_t size)
 {
     struct LzmaFileReader lfr;
@@ -0,0 +1,106 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+int output_flags = 0;
+
+#ifndef WIN32
+/* Flushes the written data of a file to disk and drops it from the page
+   cache, so it does not evict more useful data. */
+static void drop_written_data(int fd)
+{
+    if (fdatasync(fd) == 0) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* Extracts an entry by allocating the output file at its final size,
+   mapping it into memory and decoding directly into the mapping. Returns
+   (size_t)-1 if the file cannot be allocated or mapped, without consuming
+   data from src. */
+static size_t extract_mapped_file(const char *path, FILE *src,
+                                  const IndexEntry *e)
+{
+    void *data;
+    size_t size;
+    int fd;
+
+    if (e->size == 0 || (size_t)(off_t)e->size != e->size) return (size_t)-1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return (size_t)-1;
+    if (posix_fallocate(fd, 0, (off_t)e->size) != 0)
+    {
+        close(fd);
+        return (size_t)-1;
+    }
+    data = mmap(NULL, e->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return (size_t)-1;
+    }
+
+    size = decode_entry_to_buffer(data, src, e);
+
+    munmap(data, e->size);
+    if (size < e->size && ftruncate(fd, (off_t)size) != 0)
+    {
+        perror("Could not truncate file");
+    }
+    if (output_flags & OUTPUT_DROP_CACHE) drop_written_data(fd);
+    if (close(fd) != 0)
+    {
+        perror("Write failed");
+        abort();
+    }
+    return size;
+}
+#endif
+
+size_t extract_file(const char *path, FILE *src, const IndexEntry *e)
+{
+    FILE *fp;
+    size_t size = (size_t)-1;
+
+#ifndef WIN32
+    if (output_flags & OUTPUT_MAPPED) size = extract_mapped_file(path, src, e);
+#endif
+    if (size == (size_t)-1)
+    {
+        fp = fopen(path, "wb");
+        if (fp == NULL)
+        {
+            perror("Could not open file");
+            skip_data(src, e->stored_size);
+            return (size_t)-1;
+        }
+        size = decode_entry(fp, src, e);
+        if (fflush(fp) != 0)
+        {
+            perror("Write failed");
+            abort();
+        }
+#ifndef WIN32
+        if (output_flags & OUTPUT_DROP_CACHE) drop_written_data(fileno(fp));
+#endif
+        fclose(fp);
+    }
+
+#ifndef WIN32
+    /* Drop the entry's compressed data from the page cache too */
+    if (output_flags & OUTPUT_DROP_CACHE)
+    {
+        posix_fadvise(fileno(src), (off_t)e->offset, (off_t)e->stored_size,
+                      POSIX_FADV_DONTNEED);
+    }
+#endif
+    return size;
+}
@@ -0,0 +1,118 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+Overlay *create_overlay(Archive **archives, size_t archives_size)
+{
+    Overlay *ov;
+    OverlayEntry *oe;
+    size_t k, i, j, capacity;
+    const char *path;
+    uint32_t hash;
+
+    ov = malloc(sizeof(Overlay));
+    assert(ov != NULL);
+    ov->archives      = archives;
+    ov->archives_size = archives_size;
+    ov->paths         = create_hash_table(1);
+
+    capacity = 0;
+    for (k = 0; k < archives_size; ++k) capacity += archives[k]->entries_size;
+    ov->entries = malloc(sizeof(OverlayEntry)*capacity + 1);
+    assert(ov->entries != NULL);
+    ov->entries_size = 0;
+
+    /* Later archives replace entries of earlier ones with the same path,
+       keeping the index position of the first. */
+    for (k = 0; k < archives_size; ++k)
+    {
+        load_paths(archives[k]);
+        for (i = 0; i < archives[k]->entries_size; ++i)
+        {
+            path = entry_full_path(archives[k], i);
+            hash = archives[k]->hashes[i];
+            j = hash_lookup_hashed(ov->paths, path, hash);
+            if (j == (size_t)-1)
+            {
+                j = ov->entries_size++;
+                hash_insert_hashed(ov->paths, path, hash, j);
+            }
+            oe = &ov->entries[j];
+            oe->ar    = archives[k];
+            oe->entry = i;
+        }
+    }
+
+    return ov;
+}
+
+Archive **open_archives( const char * const *paths_begin,
+                         const char * const *paths_end )
+{
+    Archive **archives;
+    size_t k, n;
+
+    n = paths_end - paths_begin;
+    archives = malloc(sizeof(Archive*)*n + 1);
+    assert(archives != NULL);
+    for (k = 0; k < n; ++k)
+    {
+        archives[k] = open_archive(paths_begin[k]);
+        if (!archives[k]->seekable)
+        {
+            fprintf(stderr, "%s: not a regular file.\n", paths_begin[k]);
+            exit(1);
+        }
+    }
+    return archives;
+}
+
+Overlay *open_overlay( const char * const *paths_begin,
+                       const char * const *paths_end )
+{
+    return create_overlay( open_archives(paths_begin, paths_end),
+                           paths_end - paths_begin );
+}
+
+void free_overlay(Overlay *ov)
+{
+    free_hash_table(ov->paths);
+    free(ov->entries);
+    free(ov);
+}
+
+void close_overlay(Overlay *ov)
+{
+    size_t k;
+
+    for (k = 0; k < ov->archives_size; ++k) close_archive(ov->archives[k]);
+    free(ov->archives);
+    free_overlay(ov);
+}
+
+const OverlayEntry *find_entry(const Overlay *ov, const char *path)
+{
+    size_t j = hash_lookup(ov->paths, path);
+
+    return j != (size_t)-1 ? &ov->entries[j] : NULL;
+}
+
+int lookup_overlay_entry( Archive **archives, size_t archives_size,
+                          const char *path, OverlayEntry *oe )
+{
+    size_t k, i;
+
+    /* The last archive containing the path provides the entry */
+    for (k = archives_size; k-- > 0; )
+    {
+        i = lookup_entry(archives[k], path);
+        if (i != (size_t)-1)
+        {
+            oe->ar    = archives[k];
+            oe->entry = i;
+            return 1;
+        }
+    }
+    return 0;
+}
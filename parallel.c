@@ -0,0 +1,110 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#define MAX_THREADS 64
+
+/* Number of threads to use, or 0 to use one thread per online processor. */
+int num_threads = 0;
+
+int num_workers()
+{
+    long n = num_threads;
+
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#ifdef WIN32
+    n = 1;  /* threads are not supported on Windows (yet) */
+#endif
+    if (n < 1) n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    return (int)n;
+}
+
+#ifndef WIN32
+
+struct Job
+{
+    void (*func)(void *arg, size_t i, int worker);
+    void *arg;
+    size_t count, next;
+    pthread_mutex_t mutex;
+};
+
+struct Worker
+{
+    struct Job *job;
+    int id;
+    pthread_t thread;
+};
+
+static void *worker_main(void *arg)
+{
+    struct Worker *w = (struct Worker *)arg;
+    struct Job *job = w->job;
+    size_t i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->mutex);
+        i = job->next < job->count ? job->next++ : job->count;
+        pthread_mutex_unlock(&job->mutex);
+        if (i == job->count) break;
+        job->func(job->arg, i, w->id);
+    }
+    return NULL;
+}
+
+#endif /* ndef WIN32 */
+
+void run_parallel(size_t count, void (*func)(void *arg, size_t i, int worker),
+                  void *arg)
+{
+#ifndef WIN32
+    struct Job job;
+    struct Worker workers[MAX_THREADS];
+    int n, started;
+#endif
+    size_t i;
+
+#ifndef WIN32
+    n = num_workers();
+    if ((size_t)n > count) n = (int)count;
+    if (n > 1)
+    {
+        job.func  = func;
+        job.arg   = arg;
+        job.count = count;
+        job.next  = 0;
+        pthread_mutex_init(&job.mutex, NULL);
+
+        /* Worker 0 runs on the calling thread */
+        for (started = 1; started < n; ++started)
+        {
+            workers[started].job = &job;
+            workers[started].id  = started;
+            if (pthread_create( &workers[started].thread, NULL,
+                                worker_main, &workers[started] ) != 0)
+            {
+                break;
+            }
+        }
+        workers[0].job = &job;
+        workers[0].id  = 0;
+        worker_main(&workers[0]);
+        while (--started > 0) pthread_join(workers[started].thread, NULL);
+
+        pthread_mutex_destroy(&job.mutex);
+        return;
+    }
+#endif
+
+    for (i = 0; i < count; ++i) func(arg, i, 0);
+}
@@ -0,0 +1,168 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Archive *open_seekable_archive(const char *path)
+{
+    Archive *ar = open_archive(path);
+
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", path);
+        exit(1);
+    }
+    return ar;
+}
+
+void diff_archives( const char *old_path, const char *new_path,
+                    const char *patch_path )
+{
+    Archive *old_ar, *new_ar;
+    char path[PATH_LEN], *new_status, *old_removed;
+    size_t i, j, k, *patched, patched_size, removed_size, list_size;
+    FILE *fp_list;
+
+    old_ar = open_seekable_archive(old_path);
+    new_ar = open_seekable_archive(new_path);
+
+    /* Find added and changed entries */
+    new_status  = malloc(new_ar->entries_size + 1);
+    old_removed = malloc(old_ar->entries_size + 1);
+    patched     = malloc(sizeof(size_t)*new_ar->entries_size + 1);
+    assert(new_status != NULL && old_removed != NULL && patched != NULL);
+    compare_entries(old_ar, new_ar, new_status, old_removed, 1);
+    patched_size = 0;
+    for (j = 0; j < new_ar->entries_size; ++j)
+    {
+        if (new_status[j] != ENTRY_UNCHANGED) patched[patched_size++] = j;
+    }
+
+    /* List removed entries */
+    fp_list = tmpfile();
+    if (fp_list == NULL)
+    {
+        perror("Could not create temporary file");
+        abort();
+    }
+    removed_size = 0;
+    for (i = 0; i < old_ar->entries_size; ++i)
+    {
+        if (old_removed[i])
+        {
+            entry_path(old_ar, i, path);
+            fprintf(fp_list, "%s\n", path);
+            ++removed_size;
+        }
+    }
+    list_size = (size_t)ftell(fp_list);
+    rewind(fp_list);
+
+    /* Write patch archive */
+    begin_archive(patch_path);
+    for (k = 0; k < patched_size; ++k)
+    {
+        j = patched[k];
+        add_entry( intern_string(strat(new_ar, new_ar->entries[j].dir_name)),
+                   intern_string(strat(new_ar, new_ar->entries[j].file_name)),
+                   new_ar->entries[j].compression, new_ar->entries[j].size,
+                   new_ar->entries[j].stored_size );
+    }
+    add_entry( intern_string(PATCH_REMOVED_DIR),
+               intern_string(PATCH_REMOVED_FILE), COM_NONE, list_size, 0 );
+    write_index();
+    for (k = 0; k < patched_size; ++k)
+    {
+        j = patched[k];
+        entry_path(new_ar, j, path);
+        fprintf(fp_msg, "Adding %s...\n", path);
+        seek_entry(new_ar, j);
+        write_entry_raw( k, new_ar->fp, new_ar->entries[j].compression,
+                         new_ar->entries[j].stored_size );
+    }
+    write_entry(patched_size, fp_list, COM_LZMA);
+    end_archive();
+
+    fprintf(fp_msg, "%ld entries added or changed, %ld removed.\n",
+                    (long)patched_size, (long)removed_size);
+
+    fclose(fp_list);
+    free(patched);
+    free(new_status);
+    free(old_removed);
+    close_archive(old_ar);
+    close_archive(new_ar);
+}
+
+/* Reads the list of removed paths from a patch archive. The list entry
+   itself is included, so it is not copied into the patched archive. */
+static HashTable *read_removed_paths(Archive *patch)
+{
+    HashTable *removed;
+    char path[PATH_LEN];
+    size_t i, len;
+    FILE *fp_list;
+
+    removed = create_hash_table(1);
+    for (i = 0; i < patch->entries_size; ++i)
+    {
+        if (strcmp(strat(patch, patch->entries[i].dir_name),
+                   PATCH_REMOVED_DIR) == 0 &&
+            strcmp(strat(patch, patch->entries[i].file_name),
+                   PATCH_REMOVED_FILE) == 0) break;
+    }
+    if (i == patch->entries_size)
+    {
+        fprintf(stderr, "%s: not a patch archive.\n", patch->path);
+        exit(1);
+    }
+
+    fp_list = tmpfile();
+    if (fp_list == NULL)
+    {
+        perror("Could not create temporary file");
+        abort();
+    }
+    seek_entry(patch, i);
+    if (decode_entry(fp_list, patch->fp, &patch->entries[i])
+        != patch->entries[i].size)
+    {
+        fprintf(stderr, "%s: list of removed files is corrupt.\n",
+                        patch->path);
+        exit(1);
+    }
+    rewind(fp_list);
+    while (fgets(path, sizeof(path), fp_list) != NULL)
+    {
+        len = strlen(path);
+        if (len > 0 && path[len - 1] == '\n') path[--len] = '\0';
+        hash_insert(removed, path, 0);
+    }
+    fclose(fp_list);
+
+    entry_path(patch, i, path);
+    hash_insert(removed, path, 0);
+
+    return removed;
+}
+
+void apply_patch( const char *old_path, const char *patch_path,
+                  const char *output_path )
+{
+    Archive *ars[2];
+    Overlay *ov;
+    HashTable *removed;
+
+    ars[0] = open_seekable_archive(old_path);
+    ars[1] = open_seekable_archive(patch_path);
+    removed = read_removed_paths(ars[1]);
+
+    ov = create_overlay(ars, 2);
+    write_merged_archive(output_path, ov, removed);
+    free_overlay(ov);
+
+    free_hash_table(removed);
+    close_archive(ars[0]);
+    close_archive(ars[1]);
+}
@@ -0,0 +1,415 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <zlib.h>
+#include <LzmaDec.h>
+#endif
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+/* Size of the blocks passed between the reader, decoder and writer, and the
+   number of blocks between each pair of them (two, so one block can be
+   filled while the other is drained). */
+#define PIPELINE_BLOCK (1 << 20)
+#define PIPELINE_SLOTS 2
+
+#ifndef WIN32
+
+/* A ring of blocks passed from one thread to another */
+struct Ring
+{
+    unsigned char   *blocks[PIPELINE_SLOTS];
+    size_t          sizes[PIPELINE_SLOTS];
+    size_t          head;       /* Next block to fill */
+    size_t          count;      /* Blocks filled and not yet drained */
+    int             closed;     /* No more blocks will be filled */
+};
+
+struct Pipeline
+{
+    FILE            *src, *dst;
+    size_t          stored_size;
+    struct Ring     in;         /* Stored data, from reader to decoder */
+    struct Ring     out;        /* Decoded data, from decoder to writer */
+    pthread_mutex_t mutex;
+    pthread_cond_t  changed;    /* Signalled when any ring changes */
+};
+
+/* Waits for an empty block in the ring and returns it, to be filled */
+static unsigned char *get_empty(struct Pipeline *pl, struct Ring *r)
+{
+    unsigned char *block;
+
+    pthread_mutex_lock(&pl->mutex);
+    while (r->count == PIPELINE_SLOTS)
+        pthread_cond_wait(&pl->changed, &pl->mutex);
+    block = r->blocks[r->head];
+    pthread_mutex_unlock(&pl->mutex);
+    return block;
+}
+
+/* Passes on the block returned by get_empty(), holding ``size'' bytes */
+static void put_full(struct Pipeline *pl, struct Ring *r, size_t size)
+{
+    pthread_mutex_lock(&pl->mutex);
+    r->sizes[r->head] = size;
+    r->head = (r->head + 1)%PIPELINE_SLOTS;
+    r->count++;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/* Waits for a filled block in the ring and returns it, storing its size in
+   *size, or returns NULL if the ring is closed and drained. */
+static const unsigned char *get_full( struct Pipeline *pl, struct Ring *r,
+                                      size_t *size )
+{
+    const unsigned char *block = NULL;
+    size_t slot;
+
+    pthread_mutex_lock(&pl->mutex);
+    while (r->count == 0 && !r->closed)
+        pthread_cond_wait(&pl->changed, &pl->mutex);
+    if (r->count > 0)
+    {
+        slot  = (r->head + PIPELINE_SLOTS - r->count)%PIPELINE_SLOTS;
+        block = r->blocks[slot];
+        *size = r->sizes[slot];
+    }
+    pthread_mutex_unlock(&pl->mutex);
+    return block;
+}
+
+/* Returns the block returned by get_full() to its producer */
+static void put_empty(struct Pipeline *pl, struct Ring *r)
+{
+    pthread_mutex_lock(&pl->mutex);
+    r->count--;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+static void close_ring(struct Pipeline *pl, struct Ring *r)
+{
+    pthread_mutex_lock(&pl->mutex);
+    r->closed = 1;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+static void *reader_main(void *arg)
+{
+    struct Pipeline *pl = arg;
+    unsigned char *block;
+    size_t chunk, left;
+
+    for (left = pl->stored_size; left > 0; left -= chunk)
+    {
+        chunk = left < PIPELINE_BLOCK ? left : PIPELINE_BLOCK;
+        block = get_empty(pl, &pl->in);
+        if (fread(block, 1, chunk, pl->src) != chunk)
+        {
+            perror("Read failed");
+            abort();
+        }
+        put_full(pl, &pl->in, chunk);
+    }
+    close_ring(pl, &pl->in);
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    struct Pipeline *pl = arg;
+    const unsigned char *block;
+    size_t size;
+
+    while ((block = get_full(pl, &pl->out, &size)) != NULL)
+    {
+        if (fwrite(block, 1, size, pl->dst) != size)
+        {
+            perror("Write failed");
+            abort();
+        }
+        put_empty(pl, &pl->out);
+    }
+    return NULL;
+}
+
+/* Writes the blocks of the input ring as they are, on the calling thread,
+   for uncompressed entries. Returns the number of bytes written. */
+static size_t copy_blocks(struct Pipeline *pl)
+{
+    const unsigned char *block;
+    size_t size, total = 0;
+
+    while ((block = get_full(pl, &pl->in, &size)) != NULL)
+    {
+        if (fwrite(block, 1, size, pl->dst) != size)
+        {
+            perror("Write failed");
+            abort();
+        }
+        total += size;
+        put_empty(pl, &pl->in);
+    }
+    return total;
+}
+
+/* Decoder of deflated or LZMA data passed in consecutive memory blocks */
+struct BlockDecoder
+{
+    Compression     com;
+    z_stream        zs;
+    CLzmaDec        ld;
+    unsigned char   header[LZMA_PROPS_SIZE + 8];
+    size_t          header_size, header_pos;
+    size_t          size_out, max_out;
+};
+
+static void *lzma_alloc(void *p, size_t size)
+{
+    (void)p;
+    return malloc(size);
+}
+
+static void lzma_free(void *p, void *addr)
+{
+    (void)p;
+    free(addr);
+}
+
+static ISzAlloc szalloc = { lzma_alloc, lzma_free };
+
+static void begin_decoder(struct BlockDecoder *bd, Compression com)
+{
+    memset(bd, 0, sizeof(*bd));
+    bd->com = com;
+    if (com == COM_DEFLATE)
+    {
+        if (inflateInit2(&bd->zs, -15) != Z_OK)
+        {
+            perror("Could not initialize decoder");
+            abort();
+        }
+    }
+    else
+    {
+        LzmaDec_Construct(&bd->ld);
+        bd->header_size = LZMA_PROPS_SIZE +
+                          (lzma_omit_uncompressed_size ? 0 : 8);
+    }
+}
+
+static void end_decoder(struct BlockDecoder *bd)
+{
+    if (bd->com == COM_DEFLATE)
+        inflateEnd(&bd->zs);
+    else
+        LzmaDec_Free(&bd->ld, &szalloc);
+}
+
+/* Reads the LZMA header from the start of the stored data. Returns 0 if
+   the properties are not supported. */
+static int read_header( struct BlockDecoder *bd, const unsigned char *src,
+                        size_t *src_size )
+{
+    size_t i, chunk;
+
+    chunk = bd->header_size - bd->header_pos;
+    if (chunk > *src_size) chunk = *src_size;
+    memcpy(bd->header + bd->header_pos, src, chunk);
+    bd->header_pos += chunk;
+    *src_size = chunk;
+    if (bd->header_pos < bd->header_size) return 1;
+
+    bd->max_out = (size_t)-1;
+    if (bd->header_size > LZMA_PROPS_SIZE)
+    {
+        for (bd->max_out = 0, i = 8; i-- > 0; )
+            bd->max_out = (bd->max_out << 8) | bd->header[LZMA_PROPS_SIZE + i];
+    }
+    if (LzmaDec_Allocate(&bd->ld, bd->header, LZMA_PROPS_SIZE,
+                         &szalloc) != SZ_OK)
+    {
+        fprintf(stderr, "WARNING: LZMA decompression failed!\n");
+        return 0;
+    }
+    LzmaDec_Init(&bd->ld);
+    return 1;
+}
+
+/* Decodes up to *src_size bytes at src into up to *dst_size bytes at dst,
+   storing the number of bytes consumed and produced in *src_size and
+   *dst_size. Returns 0 if the end of the data was reached, or the data is
+   corrupt; otherwise returns 1. */
+static int decode_block( struct BlockDecoder *bd,
+                         unsigned char *dst, size_t *dst_size,
+                         const unsigned char *src, size_t *src_size )
+{
+    ELzmaFinishMode finish_mode;
+    ELzmaStatus status;
+    SizeT avail_in, avail_out;
+    int res;
+
+    if (bd->com == COM_DEFLATE)
+    {
+        bd->zs.next_in   = (Bytef*)src;
+        bd->zs.avail_in  = (uInt)*src_size;
+        bd->zs.next_out  = dst;
+        bd->zs.avail_out = (uInt)*dst_size;
+        res = inflate(&bd->zs, Z_NO_FLUSH);
+        *src_size -= bd->zs.avail_in;
+        *dst_size -= bd->zs.avail_out;
+        if (res == Z_STREAM_END) return 0;
+        if (res != Z_OK && res != Z_BUF_ERROR)
+        {
+            fprintf(stderr, "WARNING: inflate failed!\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (bd->header_pos < bd->header_size)
+    {
+        *dst_size = 0;
+        return read_header(bd, src, src_size);
+    }
+
+    finish_mode = LZMA_FINISH_ANY;
+    if (*dst_size >= bd->max_out - bd->size_out)
+    {
+        *dst_size   = bd->max_out - bd->size_out;
+        finish_mode = LZMA_FINISH_END;
+    }
+    avail_in  = *src_size;
+    avail_out = *dst_size;
+    res = LzmaDec_DecodeToBuf( &bd->ld, dst, &avail_out, src, &avail_in,
+                               finish_mode, &status );
+    *src_size = avail_in;
+    *dst_size = avail_out;
+    bd->size_out += avail_out;
+    if (res != SZ_OK)
+    {
+        fprintf(stderr, "WARNING: LZMA decompression failed!\n");
+        return 0;
+    }
+    return status != LZMA_STATUS_FINISHED_WITH_MARK &&
+           bd->size_out < bd->max_out;
+}
+
+/* Decodes the blocks of the input ring into blocks of the output ring, on
+   the calling thread. Returns the number of bytes decoded. */
+static size_t decode_blocks(struct Pipeline *pl, Compression com)
+{
+    struct BlockDecoder bd;
+    const unsigned char *in;
+    unsigned char *out;
+    size_t in_size = 0, in_pos = 0, out_pos = 0, avail_in, avail_out;
+    size_t size = 0;
+    int more;
+
+    begin_decoder(&bd, com);
+    in  = get_full(pl, &pl->in, &in_size);
+    out = get_empty(pl, &pl->out);
+    do {
+        if (in != NULL && in_pos == in_size)
+        {
+            put_empty(pl, &pl->in);
+            in = get_full(pl, &pl->in, &in_size);
+            in_pos = 0;
+        }
+        avail_in  = in != NULL ? in_size - in_pos : 0;
+        avail_out = PIPELINE_BLOCK - out_pos;
+        more = decode_block( &bd, out + out_pos, &avail_out,
+                             in != NULL ? in + in_pos : NULL, &avail_in );
+        in_pos  += avail_in;
+        out_pos += avail_out;
+        size    += avail_out;
+        if (out_pos == PIPELINE_BLOCK)
+        {
+            put_full(pl, &pl->out, out_pos);
+            out = get_empty(pl, &pl->out);
+            out_pos = 0;
+        }
+        if (more && in == NULL && avail_out == 0)
+        {
+            fprintf(stderr, "WARNING: premature end of compressed data\n");
+            more = 0;
+        }
+    } while (more);
+    end_decoder(&bd);
+
+    if (out_pos > 0) put_full(pl, &pl->out, out_pos);
+    close_ring(pl, &pl->out);
+
+    /* Drain stored data the decoder left unused, so the reader finishes */
+    while (in != NULL)
+    {
+        put_empty(pl, &pl->in);
+        in = get_full(pl, &pl->in, &in_size);
+    }
+    return size;
+}
+
+#endif /* ndef WIN32 */
+
+size_t decode_entry_pipelined(FILE *dst, FILE *src, const IndexEntry *e)
+{
+#ifndef WIN32
+    struct Pipeline pl;
+    pthread_t reader_thread, writer_thread;
+    unsigned char *blocks;
+    size_t size;
+    int k;
+
+    if (e->compression > COM_LZMA) return decode_entry_streaming(dst, src, e);
+
+    blocks = malloc((size_t)2*PIPELINE_SLOTS*PIPELINE_BLOCK);
+    if (blocks == NULL) return decode_entry_streaming(dst, src, e);
+    memset(&pl, 0, sizeof(pl));
+    for (k = 0; k < PIPELINE_SLOTS; ++k)
+    {
+        pl.in.blocks[k]  = blocks + (size_t)k*PIPELINE_BLOCK;
+        pl.out.blocks[k] = pl.in.blocks[k] + PIPELINE_SLOTS*PIPELINE_BLOCK;
+    }
+    pl.src = src;
+    pl.dst = dst;
+    pl.stored_size = e->stored_size;
+    pthread_mutex_init(&pl.mutex, NULL);
+    pthread_cond_init(&pl.changed, NULL);
+    if (pthread_create(&reader_thread, NULL, reader_main, &pl) != 0)
+    {
+        perror("Could not start pipeline threads");
+        abort();
+    }
+
+    if (e->compression == COM_NONE)
+    {
+        /* Nothing to decode; write stored blocks as they are read */
+        size = copy_blocks(&pl);
+        pthread_join(reader_thread, NULL);
+    }
+    else
+    {
+        if (pthread_create(&writer_thread, NULL, writer_main, &pl) != 0)
+        {
+            perror("Could not start pipeline threads");
+            abort();
+        }
+        size = decode_blocks(&pl, e->compression);
+        pthread_join(reader_thread, NULL);
+        pthread_join(writer_thread, NULL);
+    }
+    pthread_cond_destroy(&pl.changed);
+    pthread_mutex_destroy(&pl.mutex);
+    free(blocks);
+    return size;
+#else
+    return decode_entry_streaming(dst, src, e);
+#endif
+}
@@ -0,0 +1,133 @@
+/* Test of random access into entries.
+
+   Decodes every entry of an archive with decode_entry(), then reads ranges
+   at several offsets with pread_entry() (which uses the archive's access
+   points, if it has them) and checks that they match. Usage:
+   pread_test [-u] <archive> */
+
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+/* Decodes entry i of ``ar'' into the buffer at ``data'', using fp_tmp as
+   intermediate storage. Returns the number of bytes decoded. */
+static size_t decode_reference(Archive *ar, size_t i, FILE *fp_tmp,
+                               unsigned char *data)
+{
+    size_t size;
+
+    rewind(fp_tmp);
+    seek_entry(ar, i);
+    size = decode_entry(fp_tmp, ar->fp, &ar->entries[i]);
+    rewind(fp_tmp);
+    if (fread(data, 1, size, fp_tmp) != size)
+    {
+        perror("Read failed");
+        abort();
+    }
+    return size;
+}
+
+/* Reads ``len'' bytes of entry i at ``offset'' and compares them with the
+   reference data. Returns 1 if they match, or 0 otherwise. */
+static int check_range(Archive *ar, size_t i, const unsigned char *data,
+                       size_t size, unsigned char *buf, size_t offset,
+                       size_t len)
+{
+    size_t expected, got;
+
+    expected = offset < size ? size - offset : 0;
+    if (expected > len) expected = len;
+    got = pread_entry(ar, i, buf, offset, len);
+    if (got != expected || memcmp(buf, data + offset, got) != 0)
+    {
+        fprintf(stderr, "Entry %ld: %ld bytes at offset %ld differ "
+                        "(read %ld, expected %ld)\n", (long)i, (long)len,
+                        (long)offset, (long)got, (long)expected);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    Archive *ar;
+    FILE *fp_tmp;
+    unsigned char *data, *buf;
+    size_t i, k, max_size, size, offsets[8];
+    long ranges = 0, failed = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-u") == 0)
+    {
+        lzma_omit_uncompressed_size = 1;
+        --argc;
+        ++argv;
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: pread_test [-u] <archive>\n");
+        return 1;
+    }
+
+    ar = open_archive(argv[1]);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", argv[1]);
+        return 1;
+    }
+    fp_tmp = tmpfile();
+    if (fp_tmp == NULL)
+    {
+        perror("Could not create temporary file");
+        return 1;
+    }
+    max_size = 1;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (ar->entries[i].size > max_size) max_size = ar->entries[i].size;
+    }
+    data = malloc(max_size);
+    buf  = malloc(max_size);
+    if (data == NULL || buf == NULL)
+    {
+        perror("Could not allocate memory");
+        return 1;
+    }
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (ar->codecs[i] > COM_LZMA) continue;
+        size = decode_reference(ar, i, fp_tmp, data);
+
+        /* Offsets at both ends, around an access span and in between */
+        offsets[0] = 0;
+        offsets[1] = 1;
+        offsets[2] = size/3;
+        offsets[3] = size/2 + 7;
+        offsets[4] = access_span - 1;
+        offsets[5] = access_span + 1;
+        offsets[6] = size > 0 ? size - 1 : 0;
+        offsets[7] = size;
+        for (k = 0; k < sizeof(offsets)/sizeof(*offsets); ++k)
+        {
+            if (offsets[k] > size) continue;
+            ranges += 3;
+            failed += !check_range(ar, i, data, size, buf, offsets[k], 1);
+            failed += !check_range(ar, i, data, size, buf, offsets[k], 4096);
+            failed += !check_range(ar, i, data, size, buf, offsets[k],
+                                   size - offsets[k]);
+        }
+    }
+
+    printf("Checked %ld ranges of %ld entries: %ld failed\n",
+           ranges, (long)ar->entries_size, failed);
+
+    free(buf);
+    free(data);
+    fclose(fp_tmp);
+    close_archive(ar);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of entries per worker thread that are processed in one batch.
+   The recompressed data of every entry in a batch is kept in a temporary
+   spool file until it has been written to the output archive. */
+#define BATCH_PER_WORKER 4
+
+struct Result
+{
+    FILE        *fp;            /* Spool file with recompressed data */
+    int         raw;            /* If nonzero, copy the input data as-is */
+    Compression com;            /* Selected compression method */
+    size_t      stored_size;    /* Size of recompressed data */
+};
+
+struct Recompression
+{
+    Archive         *ar;        /* Input archive */
+    Compression     com;        /* Maximum compression method */
+    FILE            **fp_in;    /* Input archive file (per worker) */
+    FILE            **fp_tmp;   /* Decompressed data spool (per worker) */
+    size_t          first;      /* Index of first entry in current batch */
+    struct Result   *results;   /* Results for current batch */
+};
+
+static FILE *create_spool()
+{
+    FILE *fp = tmpfile();
+
+    if (fp == NULL)
+    {
+        perror("Could not create spool file");
+        abort();
+    }
+    return fp;
+}
+
+/* Decodes a single entry and compresses it again. Entries already stored
+   with the requested compression method (or an unknown one) are copied
+   as-is, and so are entries that fail to decode correctly. */
+static void recompress_entry(void *arg, size_t j, int worker)
+{
+    struct Recompression *rc = arg;
+    struct Result *r = &rc->results[j];
+    const IndexEntry *e = &rc->ar->entries[rc->first + j];
+    FILE *fp_in = rc->fp_in[worker], *fp_tmp = rc->fp_tmp[worker];
+    size_t size;
+
+    r->raw = e->compression == rc->com || e->compression > COM_LZMA;
+    if (r->raw) return;
+
+    if (fseek(fp_in, (long)e->offset, SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+    rewind(fp_tmp);
+    size = decode_entry(fp_tmp, fp_in, e);
+    if (size != e->size)
+    {
+        fprintf(stderr, "WARNING: decoded size (%ld bytes) of entry %ld "
+                        "differs from recorded size (%ld bytes); "
+                        "copying original data\n",
+                        (long)size, (long)(rc->first + j), (long)e->size);
+        r->raw = 1;
+        return;
+    }
+
+    rewind(fp_tmp);
+    rewind(r->fp);
+    r->com = rc->com;
+    r->stored_size = compress_data(r->fp, fp_tmp, size, &r->com);
+}
+
+void recompress_archive( const char *input_path, const char *output_path,
+                         Compression com )
+{
+    struct Recompression rc;
+    Archive *ar;
+    size_t i, j, batch, count;
+    int w, workers;
+    char path[PATH_LEN];
+
+    ar = open_archive(input_path);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", input_path);
+        exit(1);
+    }
+
+    /* Keep string table and index order of the input archive */
+    begin_archive(output_path);
+    add_strings(ar->strings, ar->strings_size);
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        add_entry( ar->entries[i].dir_name, ar->entries[i].file_name,
+                   ar->entries[i].compression, ar->entries[i].size,
+                   ar->entries[i].stored_size );
+    }
+    write_index();
+
+    /* Allocate per-worker files and per-batch results */
+    workers = num_workers();
+    batch   = (size_t)workers*BATCH_PER_WORKER;
+    rc.ar       = ar;
+    rc.com      = com;
+    rc.fp_in    = malloc(sizeof(FILE*)*workers);
+    rc.fp_tmp   = malloc(sizeof(FILE*)*workers);
+    rc.results  = malloc(sizeof(struct Result)*batch);
+    if (rc.fp_in == NULL || rc.fp_tmp == NULL || rc.results == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+    for (w = 0; w < workers; ++w)
+    {
+        rc.fp_in[w] = fopen(input_path, "rb");
+        if (rc.fp_in[w] == NULL)
+        {
+            perror(input_path);
+            abort();
+        }
+        rc.fp_tmp[w] = create_spool();
+    }
+    for (j = 0; j < batch; ++j) rc.results[j].fp = NULL;
+
+    for (rc.first = 0; rc.first < ar->entries_size; rc.first += count)
+    {
+        count = ar->entries_size - rc.first;
+        if (count > batch) count = batch;
+        for (j = 0; j < count; ++j)
+        {
+            if (rc.results[j].fp == NULL) rc.results[j].fp = create_spool();
+        }
+
+        /* Recompress entries in parallel */
+        run_parallel(count, recompress_entry, &rc);
+
+        /* Write results in order */
+        for (j = 0; j < count; ++j)
+        {
+            struct Result *r = &rc.results[j];
+
+            i = rc.first + j;
+            entry_path(ar, i, path);
+            if (r->raw)
+            {
+                fprintf(fp_msg, "Copying %s...\n", path);
+                seek_entry(ar, i);
+                write_entry_raw( i, ar->fp, ar->entries[i].compression,
+                                 ar->entries[i].stored_size );
+            }
+            else
+            {
+                fprintf(fp_msg, "Recompressing %s...\n", path);
+                rewind(r->fp);
+                write_entry_raw(i, r->fp, r->com, r->stored_size);
+            }
+        }
+    }
+
+    end_archive();
+
+    for (j = 0; j < batch; ++j)
+    {
+        if (rc.results[j].fp != NULL) fclose(rc.results[j].fp);
+    }
+    for (w = 0; w < workers; ++w)
+    {
+        fclose(rc.fp_in[w]);
+        fclose(rc.fp_tmp[w]);
+    }
+    free(rc.fp_in);
+    free(rc.fp_tmp);
+    free(rc.results);
+    close_archive(ar);
+}
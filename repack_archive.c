@@ -0,0 +1,121 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void repack_archive( const char *input_path, const char *output_path,
+                     const char * const *patterns_begin,
+                     const char * const *patterns_end )
+{
+    Archive *ar;
+    size_t i, j, *selected, selected_size;
+    char path[PATH_LEN];
+
+    ar = open_archive(input_path);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", input_path);
+        exit(1);
+    }
+    load_paths(ar);
+
+    selected = malloc(sizeof(size_t)*ar->entries_size);
+    if (selected == NULL && ar->entries_size > 0)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+
+    /* Build new index with a fresh string table */
+    begin_archive(output_path);
+    selected_size = 0;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (!match_patterns( patterns_begin, patterns_end,
+                             entry_full_path(ar, i) )) continue;
+
+        j = alloc_entry( strat(ar, ar->entries[i].dir_name),
+                         strat(ar, ar->entries[i].file_name),
+                         ar->entries[i].compression, ar->entries[i].size,
+                         ar->entries[i].stored_size );
+        selected[j] = i;
+        selected_size = j + 1;
+    }
+    write_index();
+
+    /* Copy data verbatim */
+    for (j = 0; j < selected_size; ++j)
+    {
+        i = selected[j];
+        entry_path(ar, i, path);
+        fprintf(fp_msg, "Copying %s...\n", path);
+        seek_entry(ar, i);
+        write_entry_raw( j, ar->fp, ar->entries[i].compression,
+                         ar->entries[i].stored_size );
+    }
+    end_archive();
+
+    fprintf(fp_msg, "%ld of %ld entries copied.\n",
+                    (long)selected_size, (long)ar->entries_size);
+
+    free(selected);
+    close_archive(ar);
+}
+
+void write_merged_archive( const char *output_path, const Overlay *ov,
+                           const HashTable *removed )
+{
+    size_t j, *selected, selected_size;
+    const OverlayEntry *oe;
+    const IndexEntry *e;
+    char path[PATH_LEN];
+
+    selected = malloc(sizeof(size_t)*ov->entries_size + 1);
+    assert(selected != NULL);
+
+    /* Build index with an interned string table */
+    begin_archive(output_path);
+    selected_size = 0;
+    for (j = 0; j < ov->entries_size; ++j)
+    {
+        oe = &ov->entries[j];
+        e  = &oe->ar->entries[oe->entry];
+        if (removed != NULL)
+        {
+            entry_path(oe->ar, oe->entry, path);
+            if (hash_lookup(removed, path) != (size_t)-1) continue;
+        }
+        add_entry( intern_string(strat(oe->ar, e->dir_name)),
+                   intern_string(strat(oe->ar, e->file_name)),
+                   e->compression, e->size, e->stored_size );
+        selected[selected_size++] = j;
+    }
+    write_index();
+
+    /* Copy data verbatim */
+    for (j = 0; j < selected_size; ++j)
+    {
+        oe = &ov->entries[selected[j]];
+        e  = &oe->ar->entries[oe->entry];
+        entry_path(oe->ar, oe->entry, path);
+        fprintf(fp_msg, "Copying %s from %s...\n", path, oe->ar->path);
+        seek_entry(oe->ar, oe->entry);
+        write_entry_raw(j, oe->ar->fp, e->compression, e->stored_size);
+    }
+    end_archive();
+
+    fprintf(fp_msg, "%ld entries written.\n", (long)selected_size);
+
+    free(selected);
+}
+
+void merge_archives( const char *output_path,
+                     const char * const *inputs_begin,
+                     const char * const *inputs_end )
+{
+    Overlay *ov;
+
+    ov = open_overlay(inputs_begin, inputs_end);
+    write_merged_archive(output_path, ov, NULL);
+    close_overlay(ov);
+}
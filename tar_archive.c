@@ -0,0 +1,457 @@
+#include "common.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define TAR_BLOCK 512
+
+/* Number of tar members per worker thread that are compressed in one batch.
+   Each member of a batch is spooled to a temporary file before it is
+   compressed. */
+#define BATCH_PER_WORKER 4
+
+/* A member of the tar stream being compressed */
+struct Member
+{
+    FILE        *fp_in;         /* Spool file with uncompressed data */
+    FILE        *fp_out;        /* Spool file with compressed data */
+    size_t      size;           /* Uncompressed size */
+    size_t      stored_size;    /* Compressed size */
+    Compression com;            /* Selected compression method */
+    size_t      entry;          /* Index of entry in the archive */
+};
+
+static FILE *create_spool()
+{
+    FILE *fp = tmpfile();
+
+    if (fp == NULL)
+    {
+        perror("Could not create spool file");
+        abort();
+    }
+    return fp;
+}
+
+static size_t tar_padding(size_t size)
+{
+    return (TAR_BLOCK - size%TAR_BLOCK)%TAR_BLOCK;
+}
+
+/* Parses a numeric header field, which is either octal or (if the high bit
+   of the first byte is set) a big-endian base-256 number. */
+static size_t parse_number(const unsigned char *field, size_t len)
+{
+    size_t i, value = 0;
+
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x7f;
+        for (i = 1; i < len; ++i) value = (value << 8) | field[i];
+        return value;
+    }
+    for (i = 0; i < len && field[i] == ' '; ++i) { }
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    {
+        value = 8*value + (field[i] - '0');
+    }
+    return value;
+}
+
+static unsigned checksum_header(const unsigned char header[TAR_BLOCK])
+{
+    unsigned sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK; ++i)
+    {
+        sum += i >= 148 && i < 156 ? ' ' : header[i];
+    }
+    return sum;
+}
+
+/* Reads the data of a member of ``size'' bytes (plus padding) into a
+   zero-terminated string, truncated to PATH_LEN - 1 characters. */
+static void read_long_data(FILE *fp, char *buf, size_t size)
+{
+    size_t len = size < PATH_LEN - 1 ? size : PATH_LEN - 1;
+
+    if (fread(buf, 1, len, fp) != len)
+    {
+        perror("Read failed");
+        abort();
+    }
+    buf[len] = '\0';
+    skip_data(fp, size - len + tar_padding(size));
+}
+
+/* Extracts the ``path'' and ``size'' records from pax extended header data
+   into ``path'' and ``size''. */
+static void parse_pax_header(const char *data, char path[PATH_LEN],
+                             size_t *size)
+{
+    const char *p, *key, *value, *end;
+    char *q;
+    long len;
+
+    for (p = data; *p != '\0'; p += len)
+    {
+        len = strtol(p, &q, 10);
+        if (len <= 0 || *q != ' ' || (size_t)len > strlen(p)) break;
+        key   = q + 1;
+        end   = p + len - 1;    /* record ends with a newline */
+        value = memchr(key, '=', end - key);
+        if (value == NULL) continue;
+        ++value;
+        if (value - key == 5 && strncmp(key, "path", 4) == 0 &&
+            (size_t)(end - value) < PATH_LEN)
+        {
+            memcpy(path, value, end - value);
+            path[end - value] = '\0';
+        }
+        if (value - key == 5 && strncmp(key, "size", 4) == 0)
+        {
+            *size = (size_t)strtol(value, NULL, 10);
+        }
+    }
+}
+
+/* Reads headers from a tar stream until the header of a regular file is
+   found, and stores its path and size. Other types of members are skipped.
+   Returns 0 at the end of the archive. */
+static int read_tar_header(FILE *fp, char path[PATH_LEN], size_t *size)
+{
+    unsigned char header[TAR_BLOCK];
+    char long_path[PATH_LEN], data[PATH_LEN];
+    size_t len, pax_size;
+    int i, type;
+
+    long_path[0] = '\0';
+    pax_size = (size_t)-1;
+    for (;;)
+    {
+        len = fread(header, 1, TAR_BLOCK, fp);
+        if (len == 0) return 0;
+        if (len != TAR_BLOCK)
+        {
+            fprintf(stderr, "WARNING: truncated tar stream\n");
+            return 0;
+        }
+        for (i = 0; i < TAR_BLOCK && header[i] == 0; ++i) { }
+        if (i == TAR_BLOCK) return 0;   /* end-of-archive marker */
+
+        if (parse_number(header + 148, 8) != checksum_header(header))
+        {
+            fprintf(stderr, "Invalid tar header checksum.\n");
+            exit(1);
+        }
+
+        *size = parse_number(header + 124, 12);
+        type  = header[156];
+        switch (type)
+        {
+        case 'L':   /* GNU long name */
+            read_long_data(fp, long_path, *size);
+            continue;
+
+        case 'x':   /* pax extended header */
+            read_long_data(fp, data, *size);
+            parse_pax_header(data, long_path, &pax_size);
+            continue;
+
+        case '0': case '\0': case '7':
+            break;
+
+        default:
+            if (type != '5' && type != 'g')
+            {
+                fprintf(stderr, "%.100s: unsupported file type; skipped.\n",
+                                (const char*)header);
+            }
+            skip_data(fp, *size + tar_padding(*size));
+            long_path[0] = '\0';
+            pax_size = (size_t)-1;
+            continue;
+        }
+
+        if (pax_size != (size_t)-1) *size = pax_size;
+        if (long_path[0] != '\0')
+        {
+            strcpy(path, long_path);
+        }
+        else
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0')
+        {
+            /* Path is split into prefix and name */
+            sprintf(path, "%.155s/%.100s", (const char*)header + 345,
+                                          (const char*)header);
+        }
+        else
+        {
+            sprintf(path, "%.100s", (const char*)header);
+        }
+        return 1;
+    }
+}
+
+/* Splits a path read from a tar stream into a directory name (empty for
+   files in the root directory) and a file name. Returns 0 if the path is
+   not acceptable. */
+static int split_path(char *path, char dir[PATH_LEN], const char **file)
+{
+    char *p;
+
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    if (!is_safe_path(path)) return 0;
+    p = strrchr(path, '/');
+    if (p == NULL)
+    {
+        dir[0] = '\0';
+        *file = path;
+    }
+    else
+    {
+        *p = '\0';
+        strcpy(dir, path);
+        *file = p + 1;
+    }
+    return **file != '\0';
+}
+
+static void compress_member(void *arg, size_t j, int worker)
+{
+    struct Member *m = (struct Member*)arg + j;
+
+    (void)worker;
+    rewind(m->fp_in);
+    rewind(m->fp_out);
+    m->stored_size = compress_data(m->fp_out, m->fp_in, m->size, &m->com);
+}
+
+void create_archive_from_tar( const char *archive_path, const char *tar_path,
+                              Compression com )
+{
+    FILE *fp_tar;
+    struct Member *members;
+    size_t j, count, batch, size;
+    char path[PATH_LEN], dir[PATH_LEN];
+    const char *file;
+
+    if (strcmp(tar_path, "-") == 0)
+    {
+        fp_tar = stdin;
+#ifdef WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else
+    {
+        fp_tar = fopen(tar_path, "rb");
+        if (fp_tar == NULL)
+        {
+            perror(tar_path);
+            exit(1);
+        }
+    }
+
+    /* Entries are added while data is written, so the archive writer
+       spools the data until the index can be written */
+    begin_spooled_archive(archive_path);
+
+    batch   = (size_t)num_workers()*BATCH_PER_WORKER;
+    members = calloc(batch, sizeof(struct Member));
+    if (members == NULL)
+    {
+        perror("Could not allocate memory");
+        abort();
+    }
+
+    do {
+        /* Read next batch of files */
+        for (count = 0; count < batch && read_tar_header(fp_tar, path, &size); )
+        {
+            if ((uint32_t)size != size)
+            {
+                fprintf(stderr, "%s: file too big; skipped.\n", path);
+                skip_data(fp_tar, size + tar_padding(size));
+                continue;
+            }
+            if (!split_path(path, dir, &file))
+            {
+                fprintf(stderr, "%s: unsafe path; skipped.\n", path);
+                skip_data(fp_tar, size + tar_padding(size));
+                continue;
+            }
+            fprintf(fp_msg, "Adding %s%s%s...\n",
+                            dir, *dir != '\0' ? "/" : "", file);
+            members[count].entry = alloc_entry(dir, file, COM_NONE, size, 0);
+
+            if (members[count].fp_in == NULL)
+            {
+                members[count].fp_in  = create_spool();
+                members[count].fp_out = create_spool();
+            }
+            rewind(members[count].fp_in);
+            copy_uncompressed(members[count].fp_in, fp_tar, size);
+            skip_data(fp_tar, tar_padding(size));
+            members[count].size = size;
+            members[count].com  = com;
+            ++count;
+        }
+
+        /* Compress batch in parallel */
+        run_parallel(count, compress_member, members);
+
+        /* Append compressed data to archive */
+        for (j = 0; j < count; ++j)
+        {
+            rewind(members[j].fp_out);
+            write_entry_raw( members[j].entry, members[j].fp_out,
+                             members[j].com, members[j].stored_size );
+        }
+    } while (count == batch);
+
+    end_archive();
+
+    for (j = 0; j < batch; ++j)
+    {
+        if (members[j].fp_in != NULL)
+        {
+            fclose(members[j].fp_in);
+            fclose(members[j].fp_out);
+        }
+    }
+    free(members);
+    if (fp_tar != stdin) fclose(fp_tar);
+}
+
+static void put_octal(char *field, size_t len, size_t value)
+{
+    sprintf(field, "%0*lo", (int)len - 1, (unsigned long)value);
+}
+
+/* Writes a tar header block of the given type for a member with the given
+   name (which must fit) and size. */
+static void write_header(FILE *fp, const char *name, size_t size, int type)
+{
+    char header[TAR_BLOCK];
+
+    memset(header, 0, sizeof(header));
+    strncpy(header, name, 100);
+    put_octal(header + 100, 8, 0644);           /* mode */
+    put_octal(header + 108, 8, 0);              /* uid */
+    put_octal(header + 116, 8, 0);              /* gid */
+    put_octal(header + 124, 12, size);
+    put_octal(header + 136, 12, (size_t)time(NULL));
+    header[156] = (char)type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    put_octal(header + 148, 7, checksum_header((unsigned char*)header));
+    if (fwrite(header, 1, TAR_BLOCK, fp) != TAR_BLOCK)
+    {
+        perror("Write failed");
+        abort();
+    }
+}
+
+static void write_padding(FILE *fp, size_t size)
+{
+    static const char zeroes[TAR_BLOCK] = { 0 };
+    size_t len = tar_padding(size);
+
+    if (fwrite(zeroes, 1, len, fp) != len)
+    {
+        perror("Write failed");
+        abort();
+    }
+}
+
+/* Writes the header(s) of the tar member for entry i, storing its path in
+   ``path''. */
+static void write_member_header( FILE *dst, const Archive *ar, size_t i,
+                                 char *path )
+{
+    char *name;
+    size_t len;
+
+    entry_path(ar, i, path);
+    name = path[0] == '.' && path[1] == '/' ? path + 2 : path;
+    len  = strlen(name);
+    if (len > 100)
+    {
+        /* Store long path in a GNU long name member */
+        write_header(dst, "././@LongLink", len + 1, 'L');
+        if (fwrite(name, 1, len + 1, dst) != len + 1)
+        {
+            perror("Write failed");
+            abort();
+        }
+        write_padding(dst, len + 1);
+    }
+    write_header(dst, name, ar->entries[i].size, '0');
+}
+
+/* Completes the tar member for entry ``e'' after ``size'' bytes of data
+   have been written, padding it to the size recorded in its header. */
+static void end_member( FILE *dst, const char *path, const IndexEntry *e,
+                        size_t size )
+{
+    if (size > e->size)
+    {
+        fprintf(stderr, "%s: decoded size (%ld bytes) exceeds recorded size "
+                        "(%ld bytes); tar stream is corrupt.\n",
+                        path, (long)size, (long)e->size);
+        exit(1);
+    }
+    if (size < e->size)
+    {
+        fprintf(stderr, "WARNING: extracted size (%ld bytes) differs from "
+                        "recorded size (%ld bytes); padding with zeroes\n",
+                        (long)size, (long)e->size);
+        for ( ; size < e->size; ++size) putc(0, dst);
+    }
+    write_padding(dst, size);
+}
+
+void write_tar_entry(FILE *dst, const Archive *ar, size_t i, FILE *src)
+{
+    char path[PATH_LEN];
+
+    write_member_header(dst, ar, i, path);
+    end_member(dst, path, &ar->entries[i],
+               decode_entry(dst, src, &ar->entries[i]));
+}
+
+void write_tar_entry_data( FILE *dst, const Archive *ar, size_t i,
+                           const void *data, size_t size )
+{
+    char path[PATH_LEN];
+
+    write_member_header(dst, ar, i, path);
+    if (size > ar->entries[i].size) size = ar->entries[i].size;
+    if (fwrite(data, 1, size, dst) != size)
+    {
+        perror("Write failed");
+        abort();
+    }
+    end_member(dst, path, &ar->entries[i], size);
+}
+
+void end_tar(FILE *dst)
+{
+    static const char zeroes[2*TAR_BLOCK] = { 0 };
+
+    if (fwrite(zeroes, 1, sizeof(zeroes), dst) != sizeof(zeroes) ||
+        fflush(dst) != 0)
+    {
+        perror("Write failed");
+        abort();
+    }
+}
@@ -0,0 +1,254 @@
+#include "common.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern char lzma_omit_uncompressed_size;  /* defined in lzma_compression.c */
+
+/* Minimum stored size of LZMA data: properties and uncompressed size */
+#define LZMA_HEADER_SIZE (lzma_omit_uncompressed_size ? 5 : 5 + 8)
+
+struct Verification
+{
+    Archive     *ar;            /* Archive being verified */
+    FILE        **fp_in;        /* Archive file (per worker) */
+    size_t      *order;         /* Entries to decode, by increasing offset */
+    size_t      *decoded;       /* Decoded size of each entry */
+    char        *mismatch;      /* Checksums that differ (CHECKSUM_ flags) */
+};
+
+/* Flags for checksums of entries that differ from the archive's table */
+#define CHECKSUM_STORED  1
+#define CHECKSUM_DECODED 2
+
+static Archive *sort_ar;    /* Archive being sorted by cmp_entry_offset() */
+
+static int cmp_entry_offset(const void *a, const void *b)
+{
+    size_t i = *(const size_t*)a, j = *(const size_t*)b;
+    const uint32_t *offsets = sort_ar->offsets;
+
+    if (offsets[i] != offsets[j]) return offsets[i] < offsets[j] ? -1 : 1;
+    return i < j ? -1 : i > j ? 1 : 0;
+}
+
+/* Prints a problem with entry i. The entry is identified by its path, or by
+   its index if its names do not point into the string table. */
+static void report(const Archive *ar, size_t i, const char *fmt, ...)
+{
+    const IndexEntry *e = &ar->entries[i];
+    char path[PATH_LEN];
+    va_list ap;
+
+    if (e->dir_name < ar->strings_size && e->file_name < ar->strings_size)
+    {
+        entry_path(ar, i, path);
+        printf("%s: ", path);
+    }
+    else
+    {
+        printf("entry %ld: ", (long)i);
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+/* Checks the index entry of entry i against the layout of the archive
+   file, without reading its data. Returns the number of problems found. */
+static size_t check_entry(const Archive *ar, size_t i)
+{
+    const IndexEntry *e = &ar->entries[i];
+    size_t data_begin, problems = 0;
+
+    data_begin = sizeof(Header) + ar->strings_size +
+                 sizeof(IndexEntry)*ar->entries_size;
+
+    if (e->dir_name >= ar->strings_size || e->file_name >= ar->strings_size)
+    {
+        report(ar, i, "name outside string table");
+        ++problems;
+    }
+    if (e->compression != COM_NONE && e->compression != COM_DEFLATE &&
+        e->compression != COM_LZMA)
+    {
+        report(ar, i, "unknown compression method %ld", (long)e->compression);
+        ++problems;
+    }
+    if (e->offset%16 != 0)
+    {
+        report(ar, i, "data at offset %ld is not 16-byte aligned",
+                      (long)e->offset);
+        ++problems;
+    }
+    if (e->offset < data_begin)
+    {
+        report(ar, i, "data at offset %ld overlaps the index",
+                      (long)e->offset);
+        ++problems;
+    }
+    if (e->offset > ar->file_size ||
+        e->stored_size > ar->file_size - e->offset)
+    {
+        report(ar, i, "data at offset %ld (%ld bytes) extends past end of "
+                      "file", (long)e->offset, (long)e->stored_size);
+        ++problems;
+    }
+    if (e->compression == COM_NONE && e->stored_size != e->size)
+    {
+        report(ar, i, "stored size %ld differs from size %ld",
+                      (long)e->stored_size, (long)e->size);
+        ++problems;
+    }
+    if (e->compression == COM_LZMA && e->stored_size < LZMA_HEADER_SIZE)
+    {
+        report(ar, i, "stored size %ld is too small for LZMA data",
+                      (long)e->stored_size);
+        ++problems;
+    }
+    return problems;
+}
+
+static void verify_entry(void *arg, size_t k, int worker)
+{
+    struct Verification *ver = arg;
+    size_t i = ver->order[k];
+    const Archive *ar = ver->ar;
+    const IndexEntry *e = &ar->entries[i];
+    FILE *fp_in = ver->fp_in[worker];
+    EntryChecksums sums;
+
+    if (ar->checksums != NULL && ar->data != NULL)
+    {
+        /* Decode from memory to check the checksums too */
+        ver->decoded[i]  = compute_checksums(&sums, entry_data(ar, i), e);
+        ver->mismatch[i] =
+            (sums.stored  != ar->checksums[i].stored  ? CHECKSUM_STORED  : 0) |
+            (sums.decoded != ar->checksums[i].decoded ? CHECKSUM_DECODED : 0);
+        return;
+    }
+
+    if (fseek(fp_in, (long)e->offset, SEEK_SET) == -1)
+    {
+        perror("Seek failed");
+        abort();
+    }
+    ver->decoded[i] = decode_entry_streaming(NULL, fp_in, e);
+}
+
+size_t verify_archive(const char *path)
+{
+    struct Verification ver;
+    Archive *ar;
+    char *valid;
+    size_t i, k, n, last, end, problems;
+    const IndexEntry *e, *f;
+    int w, workers;
+
+    ar = open_archive(path);
+    if (!ar->seekable)
+    {
+        fprintf(stderr, "%s: not a regular file.\n", path);
+        exit(1);
+    }
+
+    valid       = malloc(ar->entries_size + 1);
+    ver.ar      = ar;
+    ver.order   = malloc(sizeof(size_t)*ar->entries_size + 1);
+    ver.decoded = malloc(sizeof(size_t)*ar->entries_size + 1);
+    ver.mismatch = calloc(ar->entries_size + 1, 1);
+    assert(valid != NULL && ver.order != NULL && ver.decoded != NULL &&
+           ver.mismatch != NULL);
+
+    /* Check index entries */
+    problems = 0;
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        n = check_entry(ar, i);
+        valid[i] = n == 0;
+        problems += n;
+        ver.order[i] = i;
+    }
+
+    /* Check that the data of entries does not overlap. Entries may share
+       their data, but only if they refer to exactly the same bytes. Entries
+       that failed the checks above are ignored. */
+    sort_ar = ar;
+    qsort(ver.order, ar->entries_size, sizeof(size_t), cmp_entry_offset);
+    last = end = 0;
+    for (k = 0; k < ar->entries_size; ++k)
+    {
+        e = &ar->entries[ver.order[k]];
+        if (e->stored_size == 0 || !valid[ver.order[k]]) continue;
+        if (k > 0 && e->offset < end)
+        {
+            f = &ar->entries[last];
+            if (e->offset != f->offset || e->stored_size != f->stored_size)
+            {
+                report(ar, ver.order[k], "data overlaps entry %ld",
+                                         (long)last);
+                valid[ver.order[k]] = 0;
+                ++problems;
+            }
+        }
+        if (e->offset + e->stored_size > end)
+        {
+            last = ver.order[k];
+            end  = e->offset + e->stored_size;
+        }
+    }
+
+    /* Decode valid entries in order of increasing offset */
+    for (k = n = 0; k < ar->entries_size; ++k)
+    {
+        if (valid[ver.order[k]]) ver.order[n++] = ver.order[k];
+    }
+    if (ar->checksums != NULL) map_archive(ar);
+    workers   = num_workers();
+    ver.fp_in = malloc(sizeof(FILE*)*workers);
+    assert(ver.fp_in != NULL);
+    for (w = 0; w < workers; ++w)
+    {
+        ver.fp_in[w] = fopen(path, "rb");
+        if (ver.fp_in[w] == NULL)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    run_parallel(n, verify_entry, &ver);
+    for (w = 0; w < workers; ++w) fclose(ver.fp_in[w]);
+
+    for (i = 0; i < ar->entries_size; ++i)
+    {
+        if (valid[i] && ver.decoded[i] != ar->sizes[i])
+        {
+            report(ar, i, "decoded size %ld differs from size %ld",
+                          (long)ver.decoded[i], (long)ar->sizes[i]);
+            ++problems;
+        }
+        if (valid[i] && (ver.mismatch[i] & CHECKSUM_STORED))
+        {
+            report(ar, i, "checksum of stored data differs");
+            ++problems;
+        }
+        if (valid[i] && (ver.mismatch[i] & CHECKSUM_DECODED))
+        {
+            report(ar, i, "checksum of decoded data differs");
+            ++problems;
+        }
+    }
+    printf("%ld entries verified, %ld problems found.\n",
+           (long)ar->entries_size, (long)problems);
+
+    free(valid);
+    free(ver.order);
+    free(ver.decoded);
+    free(ver.mismatch);
+    free(ver.fp_in);
+    close_archive(ar);
+
+    return problems;
+}